@@ -5,6 +5,8 @@
 #include <cstdlib>
 #include <string>
 #include <cmath>
+#include <vector>
+#include <chrono>
 #include "../bst/bst.h"
 
 /**
@@ -24,6 +26,11 @@ public:
 	int getHeight() const;
 	void setHeight(int height);
 
+	// Getter/setter for where the tree's relayout walk queued the node: one past its index in
+	// the queue, or 0. Only meaningful to AVLTree::relayout.
+	unsigned getRelayoutSlot() const;
+	void setRelayoutSlot(unsigned slot);
+
 	// Getters for parent, left, and right. These need to be redefined since they 
 	// return pointers to AVLNodes - not plain Nodes. See the Node class in bst.h
 	// for more information.
@@ -33,6 +40,7 @@ public:
 
 protected:
 	int mHeight;
+	unsigned mRelayoutSlot;
 };
 
 /*
@@ -48,6 +56,7 @@ template<typename Key, typename Value>
 AVLNode<Key, Value>::AVLNode(const Key& key, const Value& value, AVLNode<Key, Value>* parent)
 	: Node<Key, Value>(key, value, parent)
 	, mHeight(0)
+	, mRelayoutSlot(0)
 {
 
 }
@@ -79,6 +88,18 @@ void AVLNode<Key, Value>::setHeight(int height)
 	mHeight = height;
 }
 
+template<typename Key, typename Value>
+unsigned AVLNode<Key, Value>::getRelayoutSlot() const
+{
+	return mRelayoutSlot;
+}
+
+template<typename Key, typename Value>
+void AVLNode<Key, Value>::setRelayoutSlot(unsigned slot)
+{
+	mRelayoutSlot = slot;
+}
+
 /**
 * Getter function for the parent. Used since the node inherits from a base node.
 */
@@ -119,12 +140,29 @@ template <class Key, class Value>
 class AVLTree : public BinarySearchTree<Key, Value>
 {
 public:
+	AVLTree();
+
 	// Methods for inserting/removing elements from the tree. You must implement
 	// both of these methods. 
 	virtual void insert(const std::pair<Key, Value>& keyValuePair) override;
-	void remove(const Key& key);
+	virtual void insert(typename BinarySearchTree<Key, Value>::iterator hint, const std::pair<Key, Value>& keyValuePair) override;
+	// Like insert, and returns true if the key was new or false if only its value changed, in the
+	// same single descent. A derived tree that extends insert must override this too.
+	virtual bool insert_or_assign(const std::pair<Key, Value>& keyValuePair);
+	// Returns true if the key was there.
+	virtual bool remove(const Key& key);
+
+	// Moves nodes into breadth-first order in fresh arenas for about slice at a time. Returns true
+	// once the whole tree is laid out. Writes in between join the walk instead of restarting it.
+	bool relayout(std::chrono::nanoseconds slice);
+
+protected:
+	virtual size_t nodeSize() const override;
+	virtual Node<Key, Value>* copyNode(Node<Key, Value>* aNode, void* where) override;
+	virtual void forgetNode(Node<Key, Value>* aNode) override;
 
 private:
+	bool insertBelow(AVLNode<Key, Value>* start, const std::pair<Key, Value>& keyValuePair);
 	bool isBalanced(AVLNode<Key, Value>* x);
 	int getBalance(AVLNode<Key, Value>* y);
 	void balance(AVLNode<Key, Value>* z);
@@ -132,6 +170,18 @@ private:
 	void leftRight(AVLNode<Key, Value>* b);
 	void rightRight(AVLNode<Key, Value>* c);
 	void rightLeft(AVLNode<Key, Value>* d);
+	long long relayoutIndex(Node<Key, Value>* aNode) const;
+	void relayoutEnqueue(AVLNode<Key, Value>* aNode);
+	void relayoutReach(AVLNode<Key, Value>* aNode);
+	void relayoutTouch(AVLNode<Key, Value>* aNode);
+
+	// Nodes the current relayout walk has moved or still has to move, in breadth-first order,
+	// with the next one to move at mRelayoutNext; removed nodes leave NULL behind. mRelayoutEpoch
+	// is the tree's epoch when the last walk finished.
+	std::vector<Node<Key, Value>*> mRelayoutQueue;
+	size_t mRelayoutNext;
+	unsigned long long mRelayoutEpoch;
+	bool mRelayoutStarted;
 
 	/* Helper functions are strongly encouraged to help separate the problem
 	   into smaller pieces. You should not need additional data members. */
@@ -143,25 +193,243 @@ Begin implementations for the AVLTree class.
 --------------------------------------------
 */
 
+/**
+* Default constructor for an empty AVL tree.
+*/
+template<typename Key, typename Value>
+AVLTree<Key, Value>::AVLTree()
+	: mRelayoutNext(0)
+	, mRelayoutEpoch(0)
+	, mRelayoutStarted(false)
+{
+
+}
+
 /**
 * Insert function for a key value pair. Finds location to insert the node and then balances the tree. 
 */
 template<typename Key, typename Value>
 void AVLTree<Key, Value>::insert(const std::pair<Key, Value>& keyValuePair)
 {
+	AVLTree<Key, Value>::insert_or_assign(keyValuePair);
+}
+
+template<typename Key, typename Value>
+bool AVLTree<Key, Value>::insert_or_assign(const std::pair<Key, Value>& keyValuePair)
+{
+	TREES_LATENCY_SCOPE(this->mLatency.insert);
+	this->mEpoch++;
 	//if there's no root, set new node as root
 	if(this->mRoot == NULL){
 		AVLNode<Key, Value>* tempnode = new AVLNode<Key, Value>(keyValuePair.first, keyValuePair.second, NULL);
 		this->mRoot = tempnode;
 		tempnode->setHeight(1);
+		relayoutTouch(tempnode);
+		return true;
+	}
+	return insertBelow(static_cast<AVLNode<Key, Value>*>(this->mRoot), keyValuePair);
+}
+
+/**
+* Insert function that starts looking for the insert position at hint instead of at the root,
+* which is much cheaper when keys arrive in sorted or nearly sorted runs.
+*/
+template<typename Key, typename Value>
+void AVLTree<Key, Value>::insert(typename BinarySearchTree<Key, Value>::iterator hint, const std::pair<Key, Value>& keyValuePair)
+{
+	if(this->mRoot == NULL || this->nodeOf(hint) == NULL){
+		AVLTree<Key, Value>::insert(keyValuePair);
+		return;
+	}
+	TREES_LATENCY_SCOPE(this->mLatency.insert);
+	this->mEpoch++;
+	insertBelow(static_cast<AVLNode<Key, Value>*>(this->fingerStart(keyValuePair.first, this->nodeOf(hint))), keyValuePair);
+}
+
+/**
+* Moves the tree into breadth-first order, so the top levels that every search passes through
+* share cache lines and pages, and each level follows the one above it. Nodes are taken off a
+* queue in that order and relocated into arenas that double in size up to 64K nodes, so the
+* layout is contiguous except at arena boundaries and at most one arena is partly empty.
+*
+* Each call works for about slice and then returns, so a long-lived tree can be relaid out
+* between live operations. Writes in between do not restart the walk: every node is moved once,
+* a removed node is dropped from the queue, and inserts and rotations queue any node that would
+* otherwise hang below one already moved (see relayoutTouch). Nodes queued that way land after
+* the level they belong to, so a walk under heavy writes ends less strictly breadth-first.
+* Iterators are invalidated by every call that moves nodes. Returns true when the walk has
+* finished; the next call after that starts a new walk only if the tree was written since.
+*/
+template<typename Key, typename Value>
+bool AVLTree<Key, Value>::relayout(std::chrono::nanoseconds slice)
+{
+	if(mRelayoutNext == mRelayoutQueue.size()){
+		if(mRelayoutStarted && mRelayoutEpoch == this->mEpoch){
+			return true;
+		}
+		mRelayoutQueue.clear();
+		mRelayoutNext = 0;
+		if(this->mRoot != NULL){
+			relayoutEnqueue(static_cast<AVLNode<Key, Value>*>(this->mRoot));
+		}
+		mRelayoutStarted = true;
+	}
+
+	size_t alignment = alignof(Node<Key, Value>);
+	size_t stride = (this->nodeSize() + alignment - 1) / alignment * alignment;
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + slice;
+	size_t moved = 0;
+	while(mRelayoutNext < mRelayoutQueue.size()){
+		AVLNode<Key, Value>* aNode = static_cast<AVLNode<Key, Value>*>(mRelayoutQueue[mRelayoutNext++]);
+		//removed while it waited
+		if(aNode == NULL){
+			continue;
+		}
+		void* where = this->arenaAllocate(this->nodeSize(), alignment);
+		if(where == NULL){
+			//arenas grow with the number of nodes moved so far
+			size_t done = mRelayoutNext - 1;
+			size_t nodes = done < 64 ? 64 : done < 65536 ? done : 65536;
+			this->newArena(nodes * stride);
+			where = this->arenaAllocate(this->nodeSize(), alignment);
+		}
+		if(aNode->getLeft() != NULL && relayoutIndex(aNode->getLeft()) < 0){
+			relayoutEnqueue(aNode->getLeft());
+		}
+		if(aNode->getRight() != NULL && relayoutIndex(aNode->getRight()) < 0){
+			relayoutEnqueue(aNode->getRight());
+		}
+		//copyNode points the node's queue entry at the copy, which marks the copy as moved
+		this->relocateNode(aNode, where);
+		//only look at the clock every 64 moves
+		if(++moved % 64 == 0 && std::chrono::steady_clock::now() >= deadline){
+			break;
+		}
+	}
+	this->mEpoch++;
+	if(mRelayoutNext < mRelayoutQueue.size()){
+		return false;
+	}
+	mRelayoutEpoch = this->mEpoch;
+	//the walk is over, so give the queue's memory back
+	std::vector<Node<Key, Value>*>().swap(mRelayoutQueue);
+	mRelayoutNext = 0;
+	return true;
+}
+
+/**
+* Returns the index of a node in the relayout queue, or -1 if the current walk has not reached
+* it. The node has been moved if the index is below mRelayoutNext. A slot left over from an
+* earlier walk does not point back at the node, so it reads as not reached.
+*/
+template<typename Key, typename Value>
+long long AVLTree<Key, Value>::relayoutIndex(Node<Key, Value>* aNode) const
+{
+	size_t slot = static_cast<AVLNode<Key, Value>*>(aNode)->getRelayoutSlot();
+	if(slot == 0 || slot > mRelayoutQueue.size() || mRelayoutQueue[slot - 1] != aNode){
+		return -1;
+	}
+	return slot - 1;
+}
+
+template<typename Key, typename Value>
+void AVLTree<Key, Value>::relayoutEnqueue(AVLNode<Key, Value>* aNode)
+{
+	mRelayoutQueue.push_back(aNode);
+	aNode->setRelayoutSlot(mRelayoutQueue.size());
+}
+
+/**
+* Queues a node the walk has not reached if its parent has already been moved, or if it is the
+* root, since the walk would never get to it otherwise.
+*/
+template<typename Key, typename Value>
+void AVLTree<Key, Value>::relayoutReach(AVLNode<Key, Value>* aNode)
+{
+	if(aNode == NULL || relayoutIndex(aNode) >= 0){
+		return;
+	}
+	AVLNode<Key, Value>* parent = aNode->getParent();
+	long long index = parent == NULL ? -1 : relayoutIndex(parent);
+	if(parent == NULL || (index >= 0 && (size_t)index < mRelayoutNext)){
+		relayoutEnqueue(aNode);
+	}
+}
+
+/**
+* Keeps a relayout walk in progress complete after a write. The walk relies on every node it
+* has not moved being queued or having a parent it has not moved either. A write only relinks
+* nodes on the path from the node it touched up to the root, their children, and, through
+* rotations, their grandchildren, so those are the only ones to check.
+*/
+template<typename Key, typename Value>
+void AVLTree<Key, Value>::relayoutTouch(AVLNode<Key, Value>* aNode)
+{
+	if(mRelayoutNext == mRelayoutQueue.size()){
 		return;
 	}
-	AVLNode<Key, Value>* temp = static_cast<AVLNode<Key, Value>*>(this->mRoot);
+	for(; aNode != NULL; aNode = aNode->getParent()){
+		relayoutReach(aNode);
+		AVLNode<Key, Value>* children[2] = {aNode->getLeft(), aNode->getRight()};
+		for(int i = 0; i < 2; i++){
+			if(children[i] != NULL){
+				relayoutReach(children[i]);
+				relayoutReach(children[i]->getLeft());
+				relayoutReach(children[i]->getRight());
+			}
+		}
+	}
+}
+
+/**
+* AVL trees allocate AVLNodes, which carry a height on top of the base node.
+*/
+template<typename Key, typename Value>
+size_t AVLTree<Key, Value>::nodeSize() const
+{
+	return sizeof(AVLNode<Key, Value>);
+}
+
+/**
+* Copies carry the relayout slot, so a node that is queued, or already moved, in a relayout walk
+* stays that way when it is relocated.
+*/
+template<typename Key, typename Value>
+Node<Key, Value>* AVLTree<Key, Value>::copyNode(Node<Key, Value>* aNode, void* where)
+{
+	AVLNode<Key, Value>* copy = new (where) AVLNode<Key, Value>(*static_cast<AVLNode<Key, Value>*>(aNode));
+	long long index = relayoutIndex(aNode);
+	if(index >= 0){
+		mRelayoutQueue[index] = copy;
+	}
+	return copy;
+}
+
+/**
+* Drops a freed node from the relayout queue.
+*/
+template<typename Key, typename Value>
+void AVLTree<Key, Value>::forgetNode(Node<Key, Value>* aNode)
+{
+	long long index = relayoutIndex(aNode);
+	if(index >= 0){
+		mRelayoutQueue[index] = NULL;
+	}
+}
+
+/**
+* Helper that inserts the pair somewhere in the subtree of start and then readjusts heights and
+* balances the tree. Returns false if the key was already there and only its value was replaced.
+*/
+template<typename Key, typename Value>
+bool AVLTree<Key, Value>::insertBelow(AVLNode<Key, Value>* start, const std::pair<Key, Value>& keyValuePair)
+{
+	AVLNode<Key, Value>* temp = start;
 	//inserts node appropriately
 	while(1){
 		if(temp->getKey() == keyValuePair.first){
 			temp->setValue(keyValuePair.second);
-			break;
+			return false;
 		}
 		else if(keyValuePair.first > temp->getKey() && temp->getRight() != NULL){
 			temp = temp->getRight();
@@ -182,6 +450,7 @@ void AVLTree<Key, Value>::insert(const std::pair<Key, Value>& keyValuePair)
 			break;
 		}
 	}
+	AVLNode<Key, Value>* added = temp;
 	AVLNode<Key, Value>* traveler = temp;
 	//readjusts heights
 	while(temp != this->mRoot){
@@ -203,226 +472,65 @@ void AVLTree<Key, Value>::insert(const std::pair<Key, Value>& keyValuePair)
 			break;
 		}
 	}
+	relayoutTouch(added);
+	return true;
 }
 
 /**
 * Remove function for a given key. Finds the node, reattaches pointers, and then balances when finished. 
 */
 template<typename Key, typename Value>
-void AVLTree<Key, Value>::remove(const Key& key)
+bool AVLTree<Key, Value>::remove(const Key& key)
 {
+	TREES_LATENCY_SCOPE(this->mLatency.remove);
 	AVLNode<Key, Value>* aNode = static_cast<AVLNode<Key, Value>*>(this->internalFind(key));
 	if(aNode == NULL){
-		return;
+		return false;
 	}
+	this->mEpoch++;
 
-
-	//two children case
-	else if(aNode->getRight() != NULL && aNode->getLeft() != NULL){
+	//two children case: trade items with the in-order successor, which has no left child,
+	//and remove the successor's node instead
+	if(aNode->getRight() != NULL && aNode->getLeft() != NULL){
 		AVLNode<Key, Value>* aSuccessor = aNode->getRight();
-		AVLNode<Key, Value>* aParent;
-		AVLNode<Key, Value>* traveler;
 		while(aSuccessor->getLeft()){
 			aSuccessor = aSuccessor->getLeft();
-		} 
-		//set parent's child to successor
-		if(aNode->getParent() == NULL){
-			this->mRoot = aSuccessor;
-			aSuccessor->setParent(NULL);
-		}
-		else{
-			if(aNode->getParent()->getRight() == aNode){
-				aNode->getParent()->setRight(aSuccessor);
-			}
-			else{
-				aNode->getParent()->setLeft(aSuccessor);
-			}
-			aSuccessor->setParent(aNode->getParent());
-		}
-
-		aSuccessor->setLeft(aNode->getLeft());
-		if(aSuccessor->getLeft() != NULL){
-			aSuccessor->getLeft()->setParent(aSuccessor);
-		}
-
-		if(aSuccessor->getRight() != NULL){
-			if(aSuccessor->getParent()->getLeft() == aSuccessor){
-				aSuccessor->getParent()->setLeft(aSuccessor->getRight());
-				aSuccessor->getRight()->setParent(aSuccessor->getParent());
-			}
-		}
-		else{
-			if(aSuccessor->getParent()->getLeft() == aSuccessor)
-				aSuccessor->getParent()->setLeft(NULL);
-		}
-
-		delete aNode;
-
-
-		aParent = aSuccessor;
-		traveler = aSuccessor;
-
-
-
-
-
-		//height readjustment
-		while(aParent != this->mRoot){
-			if(aParent->getHeight() + 1 > aParent->getParent()->getHeight()){
-				aParent->getParent()->setHeight(aParent->getHeight() + 1);
-				aParent = aParent->getParent();
-			}
-			else{
-				aParent = aParent->getParent();
-			}
-		}
-
-
-
-
-
-
-		//check for balance
-		while(traveler != NULL){
-			if(isBalanced(traveler)){
-				traveler = traveler->getParent();
-			}
-			else{
-				balance(traveler);
-				traveler = traveler->getParent();
-			}
 		}
+		std::swap(aNode->getItem(), aSuccessor->getItem());
+		aNode = aSuccessor;
 	}
 
-
-
-	//one child case
-	else if(aNode->getRight() != NULL || aNode->getLeft() != NULL){
-		AVLNode<Key, Value>* aBrother;
-		if(aNode->getRight() != NULL){
-			aBrother = aNode->getRight();
-		}
-		else
-			aBrother = aNode->getLeft();
-
-		AVLNode<Key, Value>* aParent = aBrother;
-		AVLNode<Key, Value>* traveler = aParent;
-
-		if(aNode->getParent() == NULL){
-			this->mRoot = aBrother;
-			aBrother->setParent(NULL);
-		}
-		else{
-			if(aNode->getParent()->getRight() == aNode){
-				aNode->getParent()->setRight(aBrother);
-			}
-			else{
-				aNode->getParent()->setLeft(aBrother);
-			}
-			aBrother->setParent(aNode->getParent());
-		}
-		delete aNode;
-
-
-
-
-
-		//height adjustment
-		if(aParent->getRight() != NULL){
-			aParent->setHeight(aParent->getRight()->getHeight() + 1);
-		}
-		else if(aParent->getLeft() != NULL){
-			aParent->setHeight(aParent->getLeft()->getHeight() + 1);
-		}
-		else
-			aParent->setHeight(1);
-
-		while(aParent != this->mRoot){
-			if(aParent->getHeight() + 1 > aParent->getParent()->getHeight()){
-				aParent->getParent()->setHeight(aParent->getHeight() + 1);
-				aParent = aParent->getParent();
-			}
-			else{
-				aParent = aParent->getParent();
-			}
-		}
-
-
-
-
-		//check for balance
-		while(traveler != NULL){
-			if(isBalanced(traveler)){
-				traveler = traveler->getParent();
-			}
-			else{
-				balance(traveler);
-				traveler = traveler->getParent();
-			}
-		}
-
+	//zero or one child case: the child, if any, takes the node's place
+	AVLNode<Key, Value>* aChild = aNode->getLeft() != NULL ? aNode->getLeft() : aNode->getRight();
+	AVLNode<Key, Value>* aParent = aNode->getParent();
+	if(aChild != NULL){
+		aChild->setParent(aParent);
+	}
+	if(aParent == NULL){
+		this->mRoot = aChild;
+	}
+	else if(aParent->getLeft() == aNode){
+		aParent->setLeft(aChild);
 	}
-
-
-
-
-
-	//no child case :(
 	else{
-		if(aNode == this->mRoot){
-			delete aNode;
-			this->mRoot = NULL;
-		}
-		else{
-			AVLNode<Key, Value>* aParent = static_cast<AVLNode<Key, Value>*>(aNode->getParent());
-			AVLNode<Key, Value>* traveler = aParent;
-			if(aNode->getParent()->getRight() == aNode){
-				aNode->getParent()->setRight(NULL);
-			}
-			else{
-				aNode->getParent()->setLeft(NULL);
-			}
-			delete aNode;
-
-
-
-
-			//height adjustment
-			if(aParent->getRight() != NULL){
-				aParent->setHeight(aParent->getRight()->getHeight() + 1);
-			}
-			else if(aParent->getLeft() != NULL){
-				aParent->setHeight(aParent->getLeft()->getHeight() + 1);
-			}
-			else
-				aParent->setHeight(1);
-
-			while(aParent != this->mRoot){
-				if(aParent->getHeight() + 1 > aParent->getParent()->getHeight()){
-					aParent->getParent()->setHeight(aParent->getHeight() + 1);
-					aParent = aParent->getParent();
-				}
-				else{
-					aParent = aParent->getParent();
-				}
-			}
-
-
-
-
-			//check for balance
-			while(traveler != NULL){
-				if(isBalanced(traveler)){
-					traveler = traveler->getParent();
-				}
-				else{
-					balance(traveler);
-					traveler = traveler->getParent();
-				}
-			}
-
-		}
+		aParent->setRight(aChild);
+	}
+	this->destroyNode(aNode);
+
+	//heights can only have shrunk, so recompute them on the way up and rebalance where needed
+	AVLNode<Key, Value>* traveler = aParent;
+	while(traveler != NULL){
+		AVLNode<Key, Value>* above = traveler->getParent();
+		int leftHeight = traveler->getLeft() == NULL ? 0 : traveler->getLeft()->getHeight();
+		int rightHeight = traveler->getRight() == NULL ? 0 : traveler->getRight()->getHeight();
+		traveler->setHeight(std::max(leftHeight, rightHeight) + 1);
+		if(!isBalanced(traveler)){
+			balance(traveler);
+		}
+		traveler = above;
 	}
+	relayoutTouch(aParent != NULL ? aParent : static_cast<AVLNode<Key, Value>*>(this->mRoot));
+	return true;
 }
 
 template<typename Key, typename Value>
@@ -487,11 +595,11 @@ void AVLTree<Key, Value>::balance(AVLNode<Key, Value>* badNode){
 			rightHeight = badNode->getRight()->getRight()->getHeight();
 		
 		//rightleft case
-		if(leftHeight >= rightHeight){
+		if(leftHeight > rightHeight){
 			rightLeft(badNode);
 		}
 		//rightright case
-		else if(leftHeight < rightHeight){
+		else{
 			rightRight(badNode);
 		}
 	}
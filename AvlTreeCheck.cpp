@@ -0,0 +1,148 @@
+/**
+* Checks AVLTree::remove against std::map. After every insert or remove the tree must hold the
+* same items in key order, and every node must have the right parent link, the right height and
+* a balance factor within one. The first broken step is printed and the exit status is 1.
+*
+* Build and run from this directory with
+*     g++ -std=c++17 -O1 -g -fsanitize=address,undefined AvlTreeCheck.cpp -o AvlTreeCheck
+*     ./AvlTreeCheck
+*
+* The fixed cases come first. They are the ones the old remove got wrong: a node with two
+* children whose successor has a right child, and a node left right-heavy (or left-heavy) with
+* an evenly balanced child on that side, which needs a single rotation.
+*/
+
+#include <iostream>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <cstdlib>
+#include "AvlTree.h"
+
+/**
+* An AVLTree that shows its root to the checks below.
+*/
+class CheckedTree : public AVLTree<int, int>
+{
+public:
+	AVLNode<int, int>* root() const
+	{
+		return static_cast<AVLNode<int, int>*>(this->mRoot);
+	}
+};
+
+/**
+* Returns the height of the subtree at aNode, or -1 if some node in it is out of order, has the
+* wrong parent or height, or is out of balance. Keys must lie strictly between low and high
+* where those are given.
+*/
+int checkSubtree(AVLNode<int, int>* aNode, AVLNode<int, int>* parent, const int* low, const int* high)
+{
+	if(aNode == NULL){
+		return 0;
+	}
+	if(aNode->getParent() != parent){
+		return -1;
+	}
+	if((low != NULL && aNode->getKey() <= *low) || (high != NULL && aNode->getKey() >= *high)){
+		return -1;
+	}
+	int leftHeight = checkSubtree(aNode->getLeft(), aNode, low, &aNode->getKey());
+	int rightHeight = checkSubtree(aNode->getRight(), aNode, &aNode->getKey(), high);
+	if(leftHeight < 0 || rightHeight < 0){
+		return -1;
+	}
+	if(leftHeight - rightHeight > 1 || rightHeight - leftHeight > 1){
+		return -1;
+	}
+	int height = std::max(leftHeight, rightHeight) + 1;
+	if(aNode->getHeight() != height){
+		return -1;
+	}
+	return height;
+}
+
+/**
+* True if the tree is a valid AVL tree holding exactly the items of expected.
+*/
+bool matches(CheckedTree& tree, const std::map<int, int>& expected)
+{
+	if(checkSubtree(tree.root(), NULL, NULL, NULL) < 0){
+		return false;
+	}
+	std::map<int, int>::const_iterator want = expected.begin();
+	if(!expected.empty()){
+		for(CheckedTree::iterator it = tree.begin(); it != tree.end(); ++it){
+			if(want == expected.end() || it->first != want->first || it->second != want->second){
+				return false;
+			}
+			++want;
+		}
+	}
+	return want == expected.end() && (tree.root() == NULL) == expected.empty();
+}
+
+/**
+* Inserts keys in order, then removes the one key, checking the tree after every step.
+*/
+bool fixedCase(const std::string& name, const std::vector<int>& keys, int removed)
+{
+	CheckedTree tree;
+	std::map<int, int> expected;
+	for(size_t i = 0; i < keys.size(); i++){
+		tree.insert(std::make_pair(keys[i], keys[i]));
+		expected[keys[i]] = keys[i];
+	}
+	tree.remove(removed);
+	expected.erase(removed);
+	bool good = matches(tree, expected);
+	std::cout << name << (good ? ": ok" : ": BROKEN") << std::endl;
+	return good;
+}
+
+/**
+* Random inserts and removes over a small key range, so removes mostly hit present keys.
+*/
+bool randomCase(unsigned seed, int range, int steps)
+{
+	std::mt19937 rng(seed);
+	CheckedTree tree;
+	std::map<int, int> expected;
+	for(int step = 0; step < steps; step++){
+		int key = rng() % range;
+		if(rng() % 2 == 0){
+			tree.insert(std::make_pair(key, step));
+			expected[key] = step;
+		}
+		else{
+			tree.remove(key);
+			expected.erase(key);
+		}
+		if(!matches(tree, expected)){
+			std::cout << "random seed " << seed << " range " << range << ": BROKEN at step " << step << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+int main()
+{
+	bool good = true;
+	good = fixedCase("two children, successor has a right child", {5, 3, 9, 2, 6, 10, 7}, 5) && good;
+	good = fixedCase("right-heavy with a balanced right child", {2, 1, 4, 3, 5}, 1) && good;
+	good = fixedCase("left-heavy with a balanced left child", {4, 5, 2, 1, 3}, 5) && good;
+	good = fixedCase("remove the only node", {1}, 1) && good;
+	good = fixedCase("remove a missing key", {2, 1, 3}, 4) && good;
+
+	bool randomGood = true;
+	for(unsigned seed = 1; seed <= 200 && randomGood; seed++){
+		randomGood = randomCase(seed, 1 + seed % 300, 2000);
+	}
+	if(randomGood){
+		std::cout << "random inserts and removes: ok" << std::endl;
+	}
+	return good && randomGood ? 0 : 1;
+}
@@ -5,6 +5,10 @@
 #include <exception>
 #include <cstdlib>
 #include <utility>
+#include <vector>
+#include <new>
+#include "LatencyHistogram.h"
+#include "MemoryUsage.h"
 
 /**
 * A templated class for a Node in a search tree. The getters for parent/left/right are virtual so that they
@@ -193,6 +197,19 @@ void Node<Key, Value>::setValue(const Value& value)
 	---------------------------------------
 */
 
+/**
+* A block of raw memory that nodes can be constructed into so that a tree can be laid out
+* contiguously. mLive counts the nodes still alive in the block so that it can be released
+* once the last of them is destroyed.
+*/
+struct NodeArena
+{
+	char* mBlock;
+	size_t mBytes;
+	size_t mUsed;
+	size_t mLive;
+};
+
 /**
 * A templated unbalanced binary search tree.
 */
@@ -204,8 +221,10 @@ public:
 	~BinarySearchTree();
 
 	virtual void insert(const std::pair<Key, Value>& keyValuePair);
-	void clear();
+	virtual void clear();
 	void print() const;
+	MemoryUsage memory_usage() const;
+	void shrink_to_fit();
 
 public:
 	/**
@@ -231,13 +250,73 @@ public:
 		friend class BinarySearchTree<Key, Value>;
 	};
 
+	/**
+	* A position in the tree that survives modifications, for paging through it. It remembers the
+	* last node it returned along with that node's key and the tree's modification epoch. If the
+	* tree has not changed since, the next item is that node's successor, found in O(1) amortized;
+	* otherwise the cursor seeks to the first key after the remembered one in O(log n). Items
+	* inserted behind the cursor are not returned, items inserted ahead of it are. Reading through
+	* a cursor never splays.
+	*/
+	class cursor
+	{
+	public:
+		// A cursor before the first item, or one that resumes after the given key.
+		cursor(const BinarySearchTree<Key, Value>& tree);
+		cursor(const BinarySearchTree<Key, Value>& tree, const Key& after);
+
+		bool next(std::pair<Key, Value>& item);
+		// Copies up to count following items into buffer and returns how many there were.
+		size_t next_page(size_t count, std::pair<Key, Value>* buffer);
+		// The key of the last item returned, usable as a page token for the second constructor.
+		const Key& last_key() const;
+
+	protected:
+		Node<Key, Value>* advance();
+
+		const BinarySearchTree<Key, Value>* mTree;
+		Node<Key, Value>* mLast;
+		Key mLastKey;
+		bool mStarted;
+		bool mAtEnd;
+		unsigned long long mEpoch;
+	};
+
 public:
 	iterator begin();
 	iterator end();
 	iterator find(const Key& key) const;
+	iterator find(const Key& key, iterator hint) const;
+	iterator lower_bound(const Key& key) const;
+	iterator upper_bound(const Key& key) const;
+	// The root node, for traversals that split the tree such as those in ParallelTree.h. Changing
+	// links through it corrupts the tree.
+	Node<Key, Value>* getRoot() const;
+	virtual void insert(iterator hint, const std::pair<Key, Value>& keyValuePair);
+#ifdef TREES_LATENCY
+	TreeLatency& latency() const;
+#endif
 
 protected:
 	Node<Key, Value>* internalFind(const Key& key) const;
+	Node<Key, Value>* internalFindFrom(const Key& key, Node<Key, Value>* start) const;
+	Node<Key, Value>* fingerStart(const Key& key, Node<Key, Value>* finger) const;
+	void insertFrom(Node<Key, Value>* start, const std::pair<Key, Value>& keyValuePair);
+	static Node<Key, Value>* nodeOf(const iterator& it);
+
+	// Nodes are either allocated with new or placed into an arena; destroyNode frees both kinds.
+	void newArena(size_t bytes);
+	void* arenaAllocate(size_t bytes, size_t alignment);
+	void destroyNode(Node<Key, Value>* aNode);
+	int arenaOf(const Node<Key, Value>* aNode) const;
+	// The size of the node type this tree allocates, and a copy of a node of that type built at
+	// where. Derived trees with bigger nodes override both.
+	virtual size_t nodeSize() const;
+	virtual Node<Key, Value>* copyNode(Node<Key, Value>* aNode, void* where);
+	// Called by destroyNode just before a node is freed, so a derived tree can drop what it
+	// still remembers about it.
+	virtual void forgetNode(Node<Key, Value>* aNode);
+	void relocateNode(Node<Key, Value>* aNode, void* where);
 	Node<Key, Value>* getSmallestNode() const;
 	void printRoot (Node<Key, Value>* root) const;
 
@@ -246,6 +325,13 @@ protected:
 
 protected:
 	Node<Key, Value>* mRoot;
+	std::vector<NodeArena> mArenas;
+	// bumped by every operation that adds, removes, rotates or moves nodes
+	unsigned long long mEpoch;
+#ifdef TREES_LATENCY
+	// finds are const, but still record their latency
+	mutable TreeLatency mLatency;
+#endif
 
 };
 
@@ -356,6 +442,111 @@ typename BinarySearchTree<Key, Value>::iterator& BinarySearchTree<Key, Value>::i
 	-------------------------------------------------------------
 */
 
+/* 
+	-----------------------------------------------------------
+	Begin implementations for the BinarySearchTree::cursor class.
+	-----------------------------------------------------------
+*/
+
+template<typename Key, typename Value>
+BinarySearchTree<Key, Value>::cursor::cursor(const BinarySearchTree<Key, Value>& tree)
+	: mTree(&tree)
+	, mLast(NULL)
+	, mLastKey()
+	, mStarted(false)
+	, mAtEnd(false)
+	, mEpoch(tree.mEpoch)
+{
+
+}
+
+template<typename Key, typename Value>
+BinarySearchTree<Key, Value>::cursor::cursor(const BinarySearchTree<Key, Value>& tree, const Key& after)
+	: mTree(&tree)
+	, mLast(NULL)
+	, mLastKey(after)
+	, mStarted(true)
+	, mAtEnd(false)
+	, mEpoch(tree.mEpoch)
+{
+
+}
+
+/**
+* Copies the next item into item and returns true, or returns false at the end of the tree.
+*/
+template<typename Key, typename Value>
+bool BinarySearchTree<Key, Value>::cursor::next(std::pair<Key, Value>& item)
+{
+	Node<Key, Value>* aNode = advance();
+	if(aNode == NULL){
+		return false;
+	}
+	item = aNode->getItem();
+	return true;
+}
+
+/**
+* Fetches a page in one call: one resume or seek, then successor steps.
+*/
+template<typename Key, typename Value>
+size_t BinarySearchTree<Key, Value>::cursor::next_page(size_t count, std::pair<Key, Value>* buffer)
+{
+	size_t filled = 0;
+	while(filled < count){
+		Node<Key, Value>* aNode = advance();
+		if(aNode == NULL){
+			break;
+		}
+		buffer[filled++] = aNode->getItem();
+	}
+	return filled;
+}
+
+template<typename Key, typename Value>
+const Key& BinarySearchTree<Key, Value>::cursor::last_key() const
+{
+	return mLastKey;
+}
+
+/**
+* Helper that moves the cursor to the next node and returns it, or NULL at the end. A cursor
+* at the end stays there until the tree changes.
+*/
+template<typename Key, typename Value>
+Node<Key, Value>* BinarySearchTree<Key, Value>::cursor::advance()
+{
+	if(mAtEnd && mEpoch == mTree->mEpoch){
+		return NULL;
+	}
+	Node<Key, Value>* aNode;
+	if(!mStarted){
+		aNode = mTree->getSmallestNode();
+	}
+	else if(mLast != NULL && mEpoch == mTree->mEpoch){
+		iterator it(mLast);
+		++it;
+		aNode = nodeOf(it);
+	}
+	else{
+		aNode = nodeOf(mTree->upper_bound(mLastKey));
+	}
+	mEpoch = mTree->mEpoch;
+	mLast = aNode;
+	mAtEnd = aNode == NULL && mStarted;
+	if(aNode != NULL){
+		mLastKey = aNode->getKey();
+		mStarted = true;
+	}
+	return aNode;
+}
+
+/* 
+	---------------------------------------------------------
+	End implementations for the BinarySearchTree::cursor class.
+	---------------------------------------------------------
+*/
+
 /* 
 	-----------------------------------------------------
 	Begin implementations for the BinarySearchTree class.
@@ -369,6 +560,7 @@ template<typename Key, typename Value>
 BinarySearchTree<Key, Value>::BinarySearchTree()
 {
 	mRoot = NULL;
+	mEpoch = 0;
 }
 
 template<typename Key, typename Value>
@@ -410,11 +602,76 @@ typename BinarySearchTree<Key, Value>::iterator BinarySearchTree<Key, Value>::en
 template<typename Key, typename Value>
 typename BinarySearchTree<Key, Value>::iterator BinarySearchTree<Key, Value>::find(const Key& key) const
 {
+	TREES_LATENCY_SCOPE(mLatency.find);
 	Node<Key, Value>* curr = internalFind(key);
 	BinarySearchTree<Key, Value>::iterator it(curr);
 	return it;
 }
 
+/**
+* Returns an iterator to the item with the given key, searching outward from the
+* position of hint instead of from the root. For a run of nearby keys this costs
+* O(log d) amortized, where d is the rank distance from the hint.
+*/
+template<typename Key, typename Value>
+typename BinarySearchTree<Key, Value>::iterator BinarySearchTree<Key, Value>::find(const Key& key, iterator hint) const
+{
+	TREES_LATENCY_SCOPE(mLatency.find);
+	Node<Key, Value>* curr = internalFindFrom(key, fingerStart(key, hint.mCurrent));
+	BinarySearchTree<Key, Value>::iterator it(curr);
+	return it;
+}
+
+/**
+* Returns an iterator to the first item whose key is not less than key, or the end iterator
+* if every key in the tree is smaller.
+*/
+template<typename Key, typename Value>
+typename BinarySearchTree<Key, Value>::iterator BinarySearchTree<Key, Value>::lower_bound(const Key& key) const
+{
+	Node<Key, Value>* best = NULL;
+	Node<Key, Value>* temp = mRoot;
+	while(temp != NULL){
+		if(temp->getKey() < key){
+			temp = temp->getRight();
+		}
+		else{
+			best = temp;
+			temp = temp->getLeft();
+		}
+	}
+	BinarySearchTree<Key, Value>::iterator it(best);
+	return it;
+}
+
+template<typename Key, typename Value>
+Node<Key, Value>* BinarySearchTree<Key, Value>::getRoot() const
+{
+	return mRoot;
+}
+
+/**
+* Returns an iterator to the first item whose key is greater than key, or the end iterator if
+* there is none.
+*/
+template<typename Key, typename Value>
+typename BinarySearchTree<Key, Value>::iterator BinarySearchTree<Key, Value>::upper_bound(const Key& key) const
+{
+	Node<Key, Value>* best = NULL;
+	Node<Key, Value>* temp = mRoot;
+	while(temp != NULL){
+		if(key < temp->getKey()){
+			best = temp;
+			temp = temp->getLeft();
+		}
+		else{
+			temp = temp->getRight();
+		}
+	}
+	BinarySearchTree<Key, Value>::iterator it(best);
+	return it;
+}
+
 /**
 * An insert method to insert into a Binary Search Tree. The tree will not remain balanced when
 * inserting.
@@ -422,12 +679,52 @@ typename BinarySearchTree<Key, Value>::iterator BinarySearchTree<Key, Value>::fi
 template<typename Key, typename Value>
 void BinarySearchTree<Key, Value>::insert(const std::pair<Key, Value>& keyValuePair)
 {
+	TREES_LATENCY_SCOPE(mLatency.insert);
+	mEpoch++;
 	if(mRoot == NULL){
 		Node<Key, Value>* tempnode = new Node<Key, Value>(keyValuePair.first, keyValuePair.second, NULL);
 		mRoot = tempnode;
 		return;
 	}
-	Node<Key, Value>* temp = mRoot;
+	insertFrom(mRoot, keyValuePair);
+}
+
+/**
+* Inserts a key value pair, starting the search for its position at hint rather than
+* at the root. An end() hint falls back to a normal insert.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::insert(iterator hint, const std::pair<Key, Value>& keyValuePair)
+{
+	if(mRoot == NULL || hint.mCurrent == NULL){
+		insert(keyValuePair);
+		return;
+	}
+	TREES_LATENCY_SCOPE(mLatency.insert);
+	mEpoch++;
+	insertFrom(fingerStart(keyValuePair.first, hint.mCurrent), keyValuePair);
+}
+
+#ifdef TREES_LATENCY
+/**
+* Returns the latency histograms for insert, find and remove. Only present when built with
+* TREES_LATENCY.
+*/
+template<typename Key, typename Value>
+TreeLatency& BinarySearchTree<Key, Value>::latency() const
+{
+	return mLatency;
+}
+#endif
+
+/**
+* Helper that walks down from start, whose subtree must cover the key, and adds
+* the pair as a new leaf or overwrites the value of an existing key.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::insertFrom(Node<Key, Value>* start, const std::pair<Key, Value>& keyValuePair)
+{
+	Node<Key, Value>* temp = start;
 	while(1){
 		if(temp->getKey() == keyValuePair.first){
 			temp->setValue(keyValuePair.second);
@@ -457,6 +754,7 @@ void BinarySearchTree<Key, Value>::insert(const std::pair<Key, Value>& keyValueP
 template<typename Key, typename Value>
 void BinarySearchTree<Key, Value>::clear()
 {
+	mEpoch++;
 	Node<Key, Value> *holder = mRoot;
 	while(holder != NULL){
 		if(holder->getRight() != NULL){
@@ -467,7 +765,7 @@ void BinarySearchTree<Key, Value>::clear()
 		}
 		else{
 			if(holder == mRoot){
-				delete holder;
+				destroyNode(holder);
 				mRoot = NULL;
 				return;
 			}
@@ -480,7 +778,7 @@ void BinarySearchTree<Key, Value>::clear()
 				else if (holder->getLeft() == holder2){
 					holder->setLeft(NULL);
 				}
-				delete holder2;
+				destroyNode(holder2);
 			}
 			
 		}
@@ -488,12 +786,15 @@ void BinarySearchTree<Key, Value>::clear()
 }
 
 /**
-* A helper function to find the smallest node in the tree.
+* A helper function to find the smallest node in the tree, or NULL if it is empty.
 */
 template<typename Key, typename Value>
 Node<Key, Value>* BinarySearchTree<Key, Value>::getSmallestNode() const
 {
 	Node<Key, Value>* temp = mRoot;
+	if(temp == NULL){
+		return NULL;
+	}
 	while(1){
 		if(temp->getLeft() == NULL){
 			return temp;
@@ -512,8 +813,55 @@ Node<Key, Value>* BinarySearchTree<Key, Value>::getSmallestNode() const
 template<typename Key, typename Value>
 Node<Key, Value>* BinarySearchTree<Key, Value>::internalFind(const Key& key) const
 {
-	Node<Key, Value>* temp = mRoot;
-	if(mRoot == NULL){
+	return internalFindFrom(key, mRoot);
+}
+
+/**
+* Gives derived trees access to the node an iterator points at.
+*/
+template<typename Key, typename Value>
+Node<Key, Value>* BinarySearchTree<Key, Value>::nodeOf(const iterator& it)
+{
+	return it.mCurrent;
+}
+
+/**
+* Helper function that climbs from a finger node through its parents until it reaches
+* the lowest ancestor whose subtree can contain key. Searching down from there instead
+* of from the root is what makes finger search cheap for runs of nearby keys. A NULL
+* finger returns the root.
+*/
+template<typename Key, typename Value>
+Node<Key, Value>* BinarySearchTree<Key, Value>::fingerStart(const Key& key, Node<Key, Value>* finger) const
+{
+	if(finger == NULL){
+		return mRoot;
+	}
+	Node<Key, Value>* temp = finger;
+	while(temp->getParent() != NULL && !(temp->getKey() == key)){
+		Node<Key, Value>* parent = temp->getParent();
+		//a left child is bounded above by its parent, a right child below
+		if(key > temp->getKey() && parent->getLeft() == temp && key < parent->getKey()){
+			break;
+		}
+		else if(key < temp->getKey() && parent->getRight() == temp && key > parent->getKey()){
+			break;
+		}
+		temp = parent;
+	}
+	return temp;
+}
+
+/**
+* Helper function to find a node with given key, k in the subtree
+* rooted at start and return a pointer to it or NULL if no item with
+* that key exists there
+*/
+template<typename Key, typename Value>
+Node<Key, Value>* BinarySearchTree<Key, Value>::internalFindFrom(const Key& key, Node<Key, Value>* start) const
+{
+	Node<Key, Value>* temp = start;
+	if(start == NULL){
 		return NULL;
 	}
 	while(1){
@@ -535,6 +883,192 @@ Node<Key, Value>* BinarySearchTree<Key, Value>::internalFind(const Key& key) con
 	}
 }
 
+/**
+* Starts a new arena of the given size. Later calls to arenaAllocate carve nodes out of it.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::newArena(size_t bytes)
+{
+	NodeArena arena;
+	arena.mBlock = static_cast<char*>(::operator new(bytes));
+	arena.mBytes = bytes;
+	arena.mUsed = 0;
+	arena.mLive = 0;
+	mArenas.push_back(arena);
+}
+
+/**
+* Returns room for one node in the newest arena, or NULL if it is full. The caller constructs
+* the node in place.
+*/
+template<typename Key, typename Value>
+void* BinarySearchTree<Key, Value>::arenaAllocate(size_t bytes, size_t alignment)
+{
+	if(mArenas.empty()){
+		return NULL;
+	}
+	NodeArena& arena = mArenas.back();
+	size_t offset = (arena.mUsed + alignment - 1) / alignment * alignment;
+	if(offset + bytes > arena.mBytes){
+		return NULL;
+	}
+	arena.mUsed = offset + bytes;
+	arena.mLive++;
+	return arena.mBlock + offset;
+}
+
+/**
+* Frees a node however it was allocated. An arena is released along with its last node.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::destroyNode(Node<Key, Value>* aNode)
+{
+	forgetNode(aNode);
+	int i = arenaOf(aNode);
+	if(i < 0){
+		delete aNode;
+		return;
+	}
+	aNode->~Node();
+	if(--mArenas[i].mLive == 0){
+		::operator delete(mArenas[i].mBlock);
+		mArenas.erase(mArenas.begin() + i);
+	}
+}
+
+/**
+* Returns the index of the arena a node was placed in, or -1 if it was allocated with new.
+*/
+template<typename Key, typename Value>
+int BinarySearchTree<Key, Value>::arenaOf(const Node<Key, Value>* aNode) const
+{
+	const char* address = reinterpret_cast<const char*>(aNode);
+	for(size_t i = 0; i < mArenas.size(); i++){
+		if(address >= mArenas[i].mBlock && address < mArenas[i].mBlock + mArenas[i].mBytes){
+			return i;
+		}
+	}
+	return -1;
+}
+
+template<typename Key, typename Value>
+size_t BinarySearchTree<Key, Value>::nodeSize() const
+{
+	return sizeof(Node<Key, Value>);
+}
+
+template<typename Key, typename Value>
+Node<Key, Value>* BinarySearchTree<Key, Value>::copyNode(Node<Key, Value>* aNode, void* where)
+{
+	return new (where) Node<Key, Value>(*aNode);
+}
+
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::forgetNode(Node<Key, Value>*)
+{
+
+}
+
+/**
+* Moves a node to where: copies it there, points its parent (or the root) and children at the
+* copy, and frees the original.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::relocateNode(Node<Key, Value>* aNode, void* where)
+{
+	Node<Key, Value>* copy = copyNode(aNode, where);
+	Node<Key, Value>* parent = aNode->getParent();
+	if(parent == NULL){
+		mRoot = copy;
+	}
+	else if(parent->getLeft() == aNode){
+		parent->setLeft(copy);
+	}
+	else{
+		parent->setRight(copy);
+	}
+	if(aNode->getLeft() != NULL){
+		aNode->getLeft()->setParent(copy);
+	}
+	if(aNode->getRight() != NULL){
+		aNode->getRight()->setParent(copy);
+	}
+	destroyNode(aNode);
+}
+
+/**
+* Returns how much heap memory the tree holds, split into the items themselves, per-node
+* overhead (vptr, links, padding and whatever a derived node adds), unused arena space and
+* malloc's own overhead.
+*/
+template<typename Key, typename Value>
+MemoryUsage BinarySearchTree<Key, Value>::memory_usage() const
+{
+	MemoryUsage usage;
+	size_t size = nodeSize();
+	size_t arenaNodes = 0;
+	std::vector<Node<Key, Value>*> stack;
+	if(mRoot != NULL){
+		stack.push_back(mRoot);
+	}
+	while(!stack.empty()){
+		Node<Key, Value>* aNode = stack.back();
+		stack.pop_back();
+		usage.payload += sizeof(std::pair<Key, Value>);
+		usage.overhead += size - sizeof(std::pair<Key, Value>);
+		if(arenaOf(aNode) < 0){
+			usage.allocator += allocatorOverhead(aNode, size);
+		}
+		else{
+			arenaNodes++;
+		}
+		if(aNode->getLeft() != NULL){
+			stack.push_back(aNode->getLeft());
+		}
+		if(aNode->getRight() != NULL){
+			stack.push_back(aNode->getRight());
+		}
+	}
+	for(size_t i = 0; i < mArenas.size(); i++){
+		usage.slack += mArenas[i].mBytes;
+		usage.allocator += allocatorOverhead(mArenas[i].mBlock, mArenas[i].mBytes);
+	}
+	usage.slack -= arenaNodes * size;
+	addVectorUsage(usage, mArenas);
+	return usage;
+}
+
+/**
+* Compacts the tree by moving every node, in key order, into one arena sized exactly for them.
+* This drops the per-node malloc overhead and the dead space left in older arenas by removes,
+* and puts neighbouring keys next to each other in memory. Iterators are invalidated.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::shrink_to_fit()
+{
+	mEpoch++;
+	std::vector<Node<Key, Value>*> nodes;
+	if(mRoot != NULL){
+		for(Node<Key, Value>* aNode = getSmallestNode(); aNode != NULL; ){
+			nodes.push_back(aNode);
+			iterator it(aNode);
+			++it;
+			aNode = it.mCurrent;
+		}
+	}
+	if(!nodes.empty()){
+		//every node type in this library aligns like the base node
+		size_t alignment = alignof(Node<Key, Value>);
+		size_t stride = (nodeSize() + alignment - 1) / alignment * alignment;
+		newArena(nodes.size() * stride);
+		//a node's links always point at the current copies of its neighbours, so moving them one
+		//at a time keeps the tree consistent
+		for(size_t i = 0; i < nodes.size(); i++){
+			relocateNode(nodes[i], arenaAllocate(nodeSize(), alignment));
+		}
+	}
+	mArenas.shrink_to_fit();
+}
 
 template<typename Key, typename Value>
 void BinarySearchTree<Key, Value>::printRoot (Node<Key, Value>* root) const
@@ -0,0 +1,600 @@
+#ifndef DURABLEAVL_H
+#define DURABLEAVL_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "AvlTree.h"
+
+/**
+* When the write-ahead log is forced to disk. FsyncEveryWrite commits each insert or remove
+* before it returns. FsyncBatched groups records and commits a group once it reaches
+* batchRecords records, or once its first record is batchMicros old when a write or tick() looks
+* at it. A crash can lose at most the pending group. The tree runs no thread of its own, so an
+* idle tree only keeps the time bound if tick() or sync() is called; otherwise the group waits
+* for the next write. FsyncNone writes groups the same way but leaves flushing to the operating
+* system.
+*/
+enum FsyncPolicy { FsyncEveryWrite, FsyncBatched, FsyncNone };
+
+struct DurabilityOptions
+{
+	DurabilityOptions()
+		: policy(FsyncBatched)
+		, batchRecords(256)
+		, batchMicros(2000)
+		, checkpointEvery(0)
+	{
+
+	}
+
+	FsyncPolicy policy;
+	int batchRecords;
+	long long batchMicros;
+	// write a checkpoint after this many logged records; 0 leaves it to checkpoint()
+	long long checkpointEvery;
+};
+
+/**
+* CRC-32 (IEEE) of a byte range, used to detect torn or corrupted log records and snapshots.
+*/
+inline uint32_t durableCrc32(const char* bytes, size_t length, uint32_t crc = 0)
+{
+	static uint32_t table[256];
+	static bool ready = false;
+	if(!ready){
+		for(uint32_t i = 0; i < 256; i++){
+			uint32_t c = i;
+			for(int k = 0; k < 8; k++){
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			}
+			table[i] = c;
+		}
+		ready = true;
+	}
+	crc = ~crc;
+	for(size_t i = 0; i < length; i++){
+		crc = table[(crc ^ static_cast<unsigned char>(bytes[i])) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+/**
+* An AVL tree whose contents survive a crash. Every insert and remove is appended to a write-ahead
+* log (path + ".wal") before it is applied, and checkpoint() writes the whole tree to a binary
+* snapshot (path + ".ckpt") and empties the log. Constructing the tree recovers it by loading the
+* snapshot and replaying the log, stopping at the first torn or corrupt record. Keys and values are
+* written as raw bytes, so both must be trivially copyable. Every write goes through a virtual
+* member, so it is logged even when called through an AVLTree or BinarySearchTree reference.
+*
+* I/O failures throw std::runtime_error. A write whose record cannot be committed is not applied,
+* and the log is cut back to its last committed record, so a torn group never ends up in front of
+* later ones. If even that fails, every later write throws.
+*/
+template <class Key, class Value>
+class DurableAVLTree : public AVLTree<Key, Value>
+{
+	static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+		"DurableAVLTree writes keys and values as raw bytes");
+public:
+	DurableAVLTree(const std::string& path, const DurabilityOptions& options = DurabilityOptions());
+	~DurableAVLTree();
+
+	virtual void insert(const std::pair<Key, Value>& keyValuePair) override;
+	virtual void insert(typename BinarySearchTree<Key, Value>::iterator hint, const std::pair<Key, Value>& keyValuePair) override;
+	virtual bool insert_or_assign(const std::pair<Key, Value>& keyValuePair) override;
+	virtual bool remove(const Key& key) override;
+	virtual void clear() override;
+
+	// Writes out and forces to disk every record logged so far.
+	void sync();
+	// Commits the pending group if it is due under the policy, for callers to run from a timer or
+	// event loop. Returns the microseconds until the group is due, or -1 if nothing is pending.
+	long long tick();
+	// Writes a snapshot of the tree next to the log and truncates the log.
+	void checkpoint();
+	// Records replayed from the log by the constructor, and records logged since the last checkpoint.
+	long long replayed() const;
+	long long logged() const;
+
+private:
+	enum RecordType { RecordInsert = 1, RecordRemove = 2, RecordClear = 3 };
+
+	// A log record is this header followed by the key and the value. The checksum covers the
+	// type, key and value.
+	struct RecordHeader
+	{
+		uint32_t mChecksum;
+		uint32_t mType;
+	};
+
+	// A snapshot is this header, mCount key/value pairs in key order, and a CRC-32 of both.
+	struct SnapshotHeader
+	{
+		char mMagic[8];
+		uint64_t mCount;
+		uint32_t mKeySize;
+		uint32_t mValueSize;
+	};
+
+	static const size_t RECORD_BYTES = sizeof(RecordHeader) + sizeof(Key) + sizeof(Value);
+
+	void append(RecordType type, const Key& key, const Value& value);
+	void checkpointIfDue();
+	void commit(bool force);
+	void recover();
+	void loadSnapshot();
+	void replayLog();
+	void writeAll(int fd, const char* bytes, size_t length);
+	void rollBack();
+	void syncDirectory();
+	void fail(const std::string& what) const;
+
+	std::string mLogPath;
+	std::string mSnapshotPath;
+	DurabilityOptions mOptions;
+	int mLog;
+	// the length of the log up to the last committed group, and whether cutting it back there
+	// after a failed commit failed too
+	off_t mCommitted;
+	bool mBroken;
+	// records appended but not yet written, and when the first of them arrived
+	std::vector<char> mPending;
+	int mPendingRecords;
+	std::chrono::steady_clock::time_point mPendingSince;
+	long long mLogged;
+	long long mReplayed;
+};
+
+/*
+--------------------------------------------------
+Begin implementations for the DurableAVLTree class.
+--------------------------------------------------
+*/
+
+/**
+* Opens (or creates) the log and snapshot at path and rebuilds the tree from them.
+*/
+template<typename Key, typename Value>
+DurableAVLTree<Key, Value>::DurableAVLTree(const std::string& path, const DurabilityOptions& options)
+	: mLogPath(path + ".wal")
+	, mSnapshotPath(path + ".ckpt")
+	, mOptions(options)
+	, mLog(-1)
+	, mCommitted(0)
+	, mBroken(false)
+	, mPendingRecords(0)
+	, mLogged(0)
+	, mReplayed(0)
+{
+	recover();
+}
+
+/**
+* Commits whatever is still pending before closing the log.
+*/
+template<typename Key, typename Value>
+DurableAVLTree<Key, Value>::~DurableAVLTree()
+{
+	try{
+		sync();
+	}
+	catch(const std::runtime_error&){
+		//nothing sensible to do about a failed write while being destroyed
+	}
+	if(mLog >= 0){
+		::close(mLog);
+	}
+}
+
+template<typename Key, typename Value>
+void DurableAVLTree<Key, Value>::insert(const std::pair<Key, Value>& keyValuePair)
+{
+	append(RecordInsert, keyValuePair.first, keyValuePair.second);
+	AVLTree<Key, Value>::insert(keyValuePair);
+	checkpointIfDue();
+}
+
+template<typename Key, typename Value>
+void DurableAVLTree<Key, Value>::insert(typename BinarySearchTree<Key, Value>::iterator hint, const std::pair<Key, Value>& keyValuePair)
+{
+	append(RecordInsert, keyValuePair.first, keyValuePair.second);
+	AVLTree<Key, Value>::insert(hint, keyValuePair);
+	checkpointIfDue();
+}
+
+template<typename Key, typename Value>
+bool DurableAVLTree<Key, Value>::insert_or_assign(const std::pair<Key, Value>& keyValuePair)
+{
+	append(RecordInsert, keyValuePair.first, keyValuePair.second);
+	bool fresh = AVLTree<Key, Value>::insert_or_assign(keyValuePair);
+	checkpointIfDue();
+	return fresh;
+}
+
+template<typename Key, typename Value>
+bool DurableAVLTree<Key, Value>::remove(const Key& key)
+{
+	append(RecordRemove, key, Value());
+	bool found = AVLTree<Key, Value>::remove(key);
+	checkpointIfDue();
+	return found;
+}
+
+template<typename Key, typename Value>
+void DurableAVLTree<Key, Value>::clear()
+{
+	append(RecordClear, Key(), Value());
+	BinarySearchTree<Key, Value>::clear();
+	checkpointIfDue();
+}
+
+template<typename Key, typename Value>
+void DurableAVLTree<Key, Value>::sync()
+{
+	commit(true);
+}
+
+template<typename Key, typename Value>
+long long DurableAVLTree<Key, Value>::tick()
+{
+	commit(false);
+	if(mPendingRecords == 0){
+		return -1;
+	}
+	long long waited = std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - mPendingSince).count();
+	return waited < mOptions.batchMicros ? mOptions.batchMicros - waited : 0;
+}
+
+/**
+* Writes the snapshot to a temporary file, forces it to disk and renames it over the old one, so
+* a crash leaves either the old or the new snapshot. Only then is the log truncated. Replaying a
+* log over a snapshot that already contains it gives the same tree, so a crash between the rename
+* and the truncate is harmless.
+*/
+template<typename Key, typename Value>
+void DurableAVLTree<Key, Value>::checkpoint()
+{
+	commit(true);
+
+	std::vector<char> bytes(sizeof(SnapshotHeader));
+	uint64_t count = 0;
+	if(this->mRoot != NULL){
+		for(typename BinarySearchTree<Key, Value>::iterator it = this->begin(); it != this->end(); ++it){
+			const char* key = reinterpret_cast<const char*>(&it->first);
+			const char* value = reinterpret_cast<const char*>(&it->second);
+			bytes.insert(bytes.end(), key, key + sizeof(Key));
+			bytes.insert(bytes.end(), value, value + sizeof(Value));
+			count++;
+		}
+	}
+	SnapshotHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.mMagic, "AVLSNAP1", 8);
+	header.mCount = count;
+	header.mKeySize = sizeof(Key);
+	header.mValueSize = sizeof(Value);
+	std::memcpy(&bytes[0], &header, sizeof(header));
+	uint32_t crc = durableCrc32(bytes.data(), bytes.size());
+	bytes.insert(bytes.end(), reinterpret_cast<const char*>(&crc), reinterpret_cast<const char*>(&crc) + sizeof(crc));
+
+	std::string temp = mSnapshotPath + ".tmp";
+	int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0){
+		fail("Could not create " + temp);
+	}
+	writeAll(fd, bytes.data(), bytes.size());
+	if(::fsync(fd) != 0){
+		::close(fd);
+		fail("Could not sync " + temp);
+	}
+	::close(fd);
+	if(::rename(temp.c_str(), mSnapshotPath.c_str()) != 0){
+		fail("Could not rename " + temp);
+	}
+	syncDirectory();
+
+	if(::ftruncate(mLog, 0) != 0 || ::fsync(mLog) != 0){
+		fail("Could not truncate " + mLogPath);
+	}
+	mCommitted = 0;
+	mLogged = 0;
+}
+
+template<typename Key, typename Value>
+long long DurableAVLTree<Key, Value>::replayed() const
+{
+	return mReplayed;
+}
+
+template<typename Key, typename Value>
+long long DurableAVLTree<Key, Value>::logged() const
+{
+	return mLogged;
+}
+
+/**
+* Adds a record to the pending group and commits the group if the policy says it is time. If that
+* commit fails the record is taken back out, since the caller will not apply the operation.
+*/
+template<typename Key, typename Value>
+void DurableAVLTree<Key, Value>::append(RecordType type, const Key& key, const Value& value)
+{
+	if(mBroken){
+		throw std::runtime_error("Log " + mLogPath + " could not be cut back after a failed write");
+	}
+	if(mPendingRecords == 0){
+		mPendingSince = std::chrono::steady_clock::now();
+	}
+	size_t at = mPending.size();
+	mPending.resize(at + RECORD_BYTES);
+	char* record = &mPending[at];
+	RecordHeader header;
+	header.mType = type;
+	std::memcpy(record + sizeof(RecordHeader), &key, sizeof(Key));
+	std::memcpy(record + sizeof(RecordHeader) + sizeof(Key), &value, sizeof(Value));
+	std::memcpy(record + sizeof(uint32_t), &header.mType, sizeof(uint32_t));
+	header.mChecksum = durableCrc32(record + sizeof(uint32_t), RECORD_BYTES - sizeof(uint32_t));
+	std::memcpy(record, &header.mChecksum, sizeof(uint32_t));
+	mPendingRecords++;
+	mLogged++;
+
+	try{
+		commit(false);
+	}
+	catch(const std::runtime_error&){
+		mPending.resize(at);
+		mPendingRecords--;
+		mLogged--;
+		throw;
+	}
+}
+
+/**
+* Called once a logged operation has been applied, so the snapshot includes it.
+*/
+template<typename Key, typename Value>
+void DurableAVLTree<Key, Value>::checkpointIfDue()
+{
+	if(mOptions.checkpointEvery > 0 && mLogged >= mOptions.checkpointEvery){
+		checkpoint();
+	}
+}
+
+/**
+* Writes the pending group to the log in one write and, unless the policy is FsyncNone, forces
+* it to disk. Without force the group is only committed once it is due under the policy. If the
+* write or the sync fails, the log is cut back to the last committed group and the group stays
+* pending, so the next commit writes it again from a clean end.
+*/
+template<typename Key, typename Value>
+void DurableAVLTree<Key, Value>::commit(bool force)
+{
+	if(mPendingRecords == 0){
+		if(force && mOptions.policy != FsyncNone && mLog >= 0 && ::fdatasync(mLog) != 0){
+			fail("Could not sync " + mLogPath);
+		}
+		return;
+	}
+	if(!force && mOptions.policy != FsyncEveryWrite){
+		long long waited = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - mPendingSince).count();
+		if(mPendingRecords < mOptions.batchRecords && waited < mOptions.batchMicros){
+			return;
+		}
+	}
+	try{
+		writeAll(mLog, mPending.data(), mPending.size());
+		if(mOptions.policy != FsyncNone && ::fdatasync(mLog) != 0){
+			fail("Could not sync " + mLogPath);
+		}
+	}
+	catch(const std::runtime_error&){
+		rollBack();
+		throw;
+	}
+	mCommitted += mPending.size();
+	mPending.clear();
+	mPendingRecords = 0;
+}
+
+/**
+* Cuts the log back to its last committed group after a failed commit. A torn group left in
+* place would end recovery early and hide every group committed after it.
+*/
+template<typename Key, typename Value>
+void DurableAVLTree<Key, Value>::rollBack()
+{
+	if(::ftruncate(mLog, mCommitted) != 0){
+		mBroken = true;
+	}
+}
+
+/**
+* Loads the snapshot, replays the log on top of it, cuts off a torn tail, and leaves the log
+* open for appending. A log created here has its directory entry forced to disk before any
+* record is committed to it, or a crash could lose the whole file.
+*/
+template<typename Key, typename Value>
+void DurableAVLTree<Key, Value>::recover()
+{
+	loadSnapshot();
+	mLog = ::open(mLogPath.c_str(), O_RDWR | O_APPEND);
+	if(mLog < 0 && errno == ENOENT){
+		mLog = ::open(mLogPath.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+		if(mLog >= 0){
+			syncDirectory();
+		}
+	}
+	if(mLog < 0){
+		fail("Could not open " + mLogPath);
+	}
+	replayLog();
+}
+
+template<typename Key, typename Value>
+void DurableAVLTree<Key, Value>::loadSnapshot()
+{
+	int fd = ::open(mSnapshotPath.c_str(), O_RDONLY);
+	if(fd < 0){
+		if(errno == ENOENT){
+			return;
+		}
+		fail("Could not open " + mSnapshotPath);
+	}
+	std::vector<char> bytes;
+	char buffer[1 << 16];
+	while(true){
+		ssize_t n = ::read(fd, buffer, sizeof(buffer));
+		if(n < 0 && errno == EINTR){
+			continue;
+		}
+		if(n < 0){
+			::close(fd);
+			fail("Could not read " + mSnapshotPath);
+		}
+		if(n == 0){
+			break;
+		}
+		bytes.insert(bytes.end(), buffer, buffer + n);
+	}
+	::close(fd);
+
+	//the snapshot only ever replaces the old one whole, so a bad one means real damage
+	SnapshotHeader header;
+	if(bytes.size() < sizeof(SnapshotHeader) + sizeof(uint32_t)){
+		throw std::runtime_error("Snapshot " + mSnapshotPath + " is truncated");
+	}
+	std::memcpy(&header, bytes.data(), sizeof(header));
+	size_t pair = sizeof(Key) + sizeof(Value);
+	if(std::memcmp(header.mMagic, "AVLSNAP1", 8) != 0 || header.mKeySize != sizeof(Key)
+		|| header.mValueSize != sizeof(Value)
+		|| bytes.size() != sizeof(SnapshotHeader) + header.mCount * pair + sizeof(uint32_t)){
+		throw std::runtime_error("Snapshot " + mSnapshotPath + " does not match this tree");
+	}
+	uint32_t crc;
+	std::memcpy(&crc, &bytes[bytes.size() - sizeof(uint32_t)], sizeof(crc));
+	if(crc != durableCrc32(bytes.data(), bytes.size() - sizeof(uint32_t))){
+		throw std::runtime_error("Snapshot " + mSnapshotPath + " is corrupt");
+	}
+
+	//pairs come in key order, so each insert starts from the previous one
+	typename BinarySearchTree<Key, Value>::iterator last = this->end();
+	const char* at = bytes.data() + sizeof(SnapshotHeader);
+	for(uint64_t i = 0; i < header.mCount; i++, at += pair){
+		std::pair<Key, Value> item;
+		std::memcpy(&item.first, at, sizeof(Key));
+		std::memcpy(&item.second, at + sizeof(Key), sizeof(Value));
+		AVLTree<Key, Value>::insert(last, item);
+		last = this->find(item.first, last);
+	}
+}
+
+template<typename Key, typename Value>
+void DurableAVLTree<Key, Value>::replayLog()
+{
+	off_t offset = 0;
+	char record[RECORD_BYTES];
+	while(true){
+		ssize_t n = ::pread(mLog, record, RECORD_BYTES, offset);
+		if(n < 0 && errno == EINTR){
+			continue;
+		}
+		if(n < 0){
+			fail("Could not read " + mLogPath);
+		}
+		if(n < (ssize_t)RECORD_BYTES){
+			break;
+		}
+		uint32_t checksum;
+		uint32_t type;
+		std::memcpy(&checksum, record, sizeof(uint32_t));
+		std::memcpy(&type, record + sizeof(uint32_t), sizeof(uint32_t));
+		if(checksum != durableCrc32(record + sizeof(uint32_t), RECORD_BYTES - sizeof(uint32_t))){
+			break;
+		}
+		std::pair<Key, Value> item;
+		std::memcpy(&item.first, record + sizeof(RecordHeader), sizeof(Key));
+		std::memcpy(&item.second, record + sizeof(RecordHeader) + sizeof(Key), sizeof(Value));
+		if(type == RecordInsert){
+			AVLTree<Key, Value>::insert(item);
+		}
+		else if(type == RecordRemove){
+			AVLTree<Key, Value>::remove(item.first);
+		}
+		else if(type == RecordClear){
+			BinarySearchTree<Key, Value>::clear();
+		}
+		else{
+			break;
+		}
+		offset += RECORD_BYTES;
+		mReplayed++;
+	}
+
+	//whatever follows the last good record was never committed, so drop it
+	if(::ftruncate(mLog, offset) != 0){
+		fail("Could not truncate " + mLogPath);
+	}
+	mCommitted = offset;
+	mLogged = mReplayed;
+}
+
+template<typename Key, typename Value>
+void DurableAVLTree<Key, Value>::writeAll(int fd, const char* bytes, size_t length)
+{
+	size_t written = 0;
+	while(written < length){
+		ssize_t n = ::write(fd, bytes + written, length - written);
+		if(n < 0 && errno == EINTR){
+			continue;
+		}
+		if(n <= 0){
+			fail("Could not write to the log or snapshot");
+		}
+		written += n;
+	}
+}
+
+/**
+* Forces the directory entries of a newly created log or a renamed snapshot to disk.
+*/
+template<typename Key, typename Value>
+void DurableAVLTree<Key, Value>::syncDirectory()
+{
+	size_t slash = mSnapshotPath.find_last_of('/');
+	std::string directory = slash == std::string::npos ? "." : mSnapshotPath.substr(0, slash + 1);
+	int fd = ::open(directory.c_str(), O_RDONLY);
+	if(fd < 0){
+		fail("Could not open " + directory);
+	}
+	int result = ::fsync(fd);
+	::close(fd);
+	if(result != 0){
+		fail("Could not sync " + directory);
+	}
+}
+
+template<typename Key, typename Value>
+void DurableAVLTree<Key, Value>::fail(const std::string& what) const
+{
+	throw std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+/*
+------------------------------------------------
+End implementations for the DurableAVLTree class.
+------------------------------------------------
+*/
+
+#endif
@@ -0,0 +1,152 @@
+/**
+* Checks that DurableAVLTree keeps every acknowledged write across a failed log write. The file
+* size limit (RLIMIT_FSIZE) is lowered so the next group is cut off halfway through a record,
+* the way a full disk would, and then raised again. After later writes succeed, the tree is
+* reopened from its log: it must hold every write that returned and none that threw. The first
+* broken case is printed and the exit status is 1.
+*
+* Build and run from this directory with
+*     g++ -std=c++17 -O1 -g -fsanitize=address,undefined DurableAvlTreeCheck.cpp -o DurableAvlTreeCheck
+*     ./DurableAvlTreeCheck
+*
+* It also checks that writes made through an AVLTree or BinarySearchTree reference are logged.
+*/
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <stdexcept>
+#include <csignal>
+#include <cstdlib>
+#include <sys/resource.h>
+#include "DurableAvlTree.h"
+
+/**
+* True if the tree holds exactly the items of expected.
+*/
+bool matches(DurableAVLTree<int, int>& tree, const std::map<int, int>& expected)
+{
+	std::map<int, int>::const_iterator want = expected.begin();
+	if(tree.getRoot() != NULL){
+		for(BinarySearchTree<int, int>::iterator it = tree.begin(); it != tree.end(); ++it){
+			if(want == expected.end() || it->first != want->first || it->second != want->second){
+				return false;
+			}
+			++want;
+		}
+	}
+	return want == expected.end();
+}
+
+/**
+* Caps the size of files this process writes, so writes past it fail with EFBIG.
+*/
+void limitFileSize(rlim_t bytes)
+{
+	rlimit limit;
+	getrlimit(RLIMIT_FSIZE, &limit);
+	limit.rlim_cur = bytes;
+	setrlimit(RLIMIT_FSIZE, &limit);
+}
+
+off_t fileSize(const std::string& path)
+{
+	struct stat info;
+	return ::stat(path.c_str(), &info) == 0 ? info.st_size : -1;
+}
+
+/**
+* Logs a few writes, makes the commit of the next group fail halfway through a record, then logs
+* more. With batchRecords above 1 the failed group also carries writes that had already returned;
+* those must stay pending and be committed later, while the write whose commit failed is dropped.
+*/
+bool failedWrite(const std::string& name, const std::string& path, int batchRecords)
+{
+	DurabilityOptions options;
+	options.policy = batchRecords == 1 ? FsyncEveryWrite : FsyncBatched;
+	options.batchRecords = batchRecords;
+	options.batchMicros = 1000000000;
+	std::map<int, int> expected;
+	bool good = true;
+	{
+		DurableAVLTree<int, int> tree(path, options);
+		for(int i = 0; i < 2 * batchRecords + batchRecords - 1; i++){
+			tree.insert(std::make_pair(i, i));
+			expected[i] = i;
+		}
+
+		//the next insert commits a group; let only half a record of it reach the file
+		limitFileSize(fileSize(path + ".wal") + 8);
+		bool threw = false;
+		try{
+			tree.insert(std::make_pair(1000, 1000));
+		}
+		catch(const std::runtime_error&){
+			threw = true;
+		}
+		limitFileSize(RLIM_INFINITY);
+		good = threw && tree.find(1000) == tree.end() && matches(tree, expected);
+
+		for(int i = 0; i < 3 * batchRecords; i++){
+			tree.insert(std::make_pair(2000 + i, i));
+			expected[2000 + i] = i;
+		}
+		tree.sync();
+	}
+	DurableAVLTree<int, int> reopened(path, options);
+	good = good && matches(reopened, expected);
+	std::cout << name << (good ? ": ok" : ": BROKEN") << std::endl;
+	return good;
+}
+
+/**
+* Writes through base class references must reach the log too.
+*/
+bool baseReference(const std::string& path)
+{
+	std::map<int, int> expected;
+	{
+		DurableAVLTree<int, int> tree(path);
+		AVLTree<int, int>& avl = tree;
+		BinarySearchTree<int, int>& bst = tree;
+		for(int i = 0; i < 10; i++){
+			bst.insert(std::make_pair(i, i));
+		}
+		bst.clear();
+		for(int i = 0; i < 10; i++){
+			avl.insert_or_assign(std::make_pair(i, 2 * i));
+			expected[i] = 2 * i;
+		}
+		avl.remove(3);
+		expected.erase(3);
+	}
+	DurableAVLTree<int, int> reopened(path);
+	bool good = matches(reopened, expected);
+	std::cout << "writes through base references" << (good ? ": ok" : ": BROKEN") << std::endl;
+	return good;
+}
+
+int main()
+{
+	//a write past the size limit should fail with EFBIG, not kill the process
+	std::signal(SIGXFSZ, SIG_IGN);
+	char directory[] = "/tmp/DurableAvlTreeCheck.XXXXXX";
+	if(mkdtemp(directory) == NULL){
+		std::cout << "could not create a scratch directory" << std::endl;
+		return 1;
+	}
+	std::string base = directory;
+
+	bool good = true;
+	good = failedWrite("failed write, one record per group", base + "/every", 1) && good;
+	good = failedWrite("failed write, four records per group", base + "/batched", 4) && good;
+	good = baseReference(base + "/base") && good;
+
+	std::string names[] = {"every", "batched", "base"};
+	for(int i = 0; i < 3; i++){
+		::unlink((base + "/" + names[i] + ".wal").c_str());
+		::unlink((base + "/" + names[i] + ".ckpt").c_str());
+	}
+	::rmdir(directory);
+	return good ? 0 : 1;
+}
@@ -0,0 +1,532 @@
+#ifndef EXTERNALHEAP_H
+#define EXTERNALHEAP_H
+
+#include "Heap.h"
+#include <cstdio>
+#include <cerrno>
+#include <future>
+#include <functional>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+
+using namespace std;
+
+template <typename T, typename Priority = int, typename Compare = std::less<Priority> >
+class ExternalHeap {
+    static_assert(std::is_trivially_copyable<T>::value && std::is_trivially_copyable<Priority>::value,
+                  "ExternalHeap writes items and priorities to disk as raw bytes");
+    public:
+        ExternalHeap (size_t memory_budget = 64u << 20, size_t block_bytes = 1u << 20);
+        /* Constructor that builds an empty external-memory min heap. New
+          items go to an in-RAM MinHeap of half of memory_budget. When it
+          is full it is drained into a sorted run in a temporary file, so
+          the heap can hold far more items than fit in memory.
+          Removing merges the buffer with the heads of all runs. Each run
+          keeps one block of block_bytes in memory and reads the next one
+          ahead in the background, and the other half of the budget bounds
+          those two blocks per run: once that many runs are on disk, the
+          smaller half of them are merged into one before the next spill.
+          block_bytes is lowered if the budget would not fit two runs.
+          Throws std::runtime_error if the temporary file cannot be created
+          or written. */
+
+        ~ExternalHeap ();
+
+        ExternalHeap (const ExternalHeap & other) = delete;
+        ExternalHeap & operator= (const ExternalHeap & other) = delete;
+
+        void add (T item, Priority priority);
+         /* adds the item to the heap, with the given priority. Throws
+            std::runtime_error if a spill or merge fails, and the heap is
+            then left as it was. */
+
+        const T & peek () const;
+         /* returns the element with smallest priority, with ties broken
+            by operator< on the T data, like MinHeap. */
+
+        void remove ();
+         /* removes the element with smallest priority. Throws
+            std::runtime_error if the next block of a run cannot be read,
+            and the heap is then left as it was. */
+
+        bool isEmpty ();
+         /* returns true iff there are no elements on the heap. */
+
+        long long runs () const;
+         /* returns the number of runs spilled to disk that still hold
+            elements. */
+
+    private:
+        struct record{
+            Priority priority;
+            T value;
+        };
+
+        typedef MinHeap<std::pair<T, int>, 4, Priority, Compare> head_heap;
+
+        // a sorted run on disk: the records from offset on have not been
+        // read yet, block holds the ones being merged, and ahead is the read
+        // of the next ahead_count records if one is in flight. The run owns
+        // the bytes from start to stop of the file, and head is its entry
+        // in heads. A run whose block is empty is used up and its slot is
+        // free for the next one.
+        struct run{
+            off_t start;
+            off_t stop;
+            off_t offset;
+            long long left;
+            std::vector<record> block;
+            size_t pos;
+            std::future<std::vector<record> > ahead;
+            size_t ahead_count;
+            typename head_heap::handle head;
+        };
+
+        void spill();
+        void merge();
+        int newRun(off_t start, off_t stop, std::vector<record> & first, long long left);
+        void retire(int r);
+        void addHead(int r);
+        void prefetch(int r);
+        void unfetch(run & current);
+        std::vector<record> nextBlock(run & current);
+        long long remaining(const run & current) const;
+        bool fromBuffer() const;
+        void writeRecords(const record * data, size_t count, off_t at);
+        static std::vector<record> readBlock(int fd, off_t offset, size_t count);
+
+        MinHeap<T, 4, Priority, Compare> buffer;
+        // one entry per run that is not used up, holding its current record
+        // with the run's index alongside so ties still go by T
+        head_heap heads;
+        std::vector<run> files;
+        std::vector<int> free_runs;
+        FILE * file;
+        int fd;
+        off_t end;
+        size_t capacity;
+        size_t block_records;
+        size_t max_runs;
+        size_t buffered;
+        long long size;
+        long long live_runs;
+        Compare cmp;
+};
+
+template <typename T, typename Priority, typename Compare>
+ExternalHeap<T, Priority, Compare>::ExternalHeap(size_t memory_budget, size_t block_bytes){
+    // half the budget buffers new items and half holds the runs' blocks
+    size_t half = memory_budget / 2;
+    // a buffered item also costs the heap's handle and position bookkeeping
+    capacity = half / (sizeof(record) + 4 * sizeof(int));
+    if(capacity < 1)
+        capacity = 1;
+    block_records = block_bytes / sizeof(record);
+    // two runs of two blocks each are the least a merge can work with
+    if(block_records > half / (4 * sizeof(record)))
+        block_records = half / (4 * sizeof(record));
+    if(block_records < 1)
+        block_records = 1;
+    max_runs = half / (2 * block_records * sizeof(record));
+    if(max_runs < 2)
+        max_runs = 2;
+    buffered = 0;
+    size = 0;
+    live_runs = 0;
+    end = 0;
+    file = std::tmpfile();
+    if(file == NULL){
+        throw std::runtime_error("Could not create the spill file");
+    }
+    fd = fileno(file);
+}
+
+template <typename T, typename Priority, typename Compare>
+ExternalHeap<T, Priority, Compare>::~ExternalHeap(){
+    // a future from std::async waits for its read in its destructor, so the
+    // file stays open until no read can touch it
+    files.clear();
+    std::fclose(file);
+}
+
+template <typename T, typename Priority, typename Compare>
+void ExternalHeap<T, Priority, Compare>::add(T item, Priority priority){
+    if(buffered == capacity)
+        spill();
+    buffer.add(item, priority);
+    buffered++;
+    size++;
+}
+
+template <typename T, typename Priority, typename Compare>
+const T & ExternalHeap<T, Priority, Compare>::peek() const{
+    if(size == 0){
+        throw std::out_of_range("Index is out of range");
+    }
+    if(fromBuffer())
+        return buffer.peek();
+    return heads.peek().first;
+}
+
+template <typename T, typename Priority, typename Compare>
+void ExternalHeap<T, Priority, Compare>::remove(){
+    if(size == 0){
+        throw std::out_of_range("Index is out of range");
+    }
+    if(fromBuffer()){
+        buffer.remove();
+        buffered--;
+    }
+    else{
+        int r = heads.peek().second;
+        run & current = files[r];
+        if(current.pos + 1 < current.block.size()){
+            heads.remove();
+            current.pos++;
+            addHead(r);
+        }
+        else{
+            // read the next block before anything changes, so a failed
+            // read leaves the head where it was
+            std::vector<record> next = nextBlock(current);
+            heads.remove();
+            if(next.empty()){
+                retire(r);
+            }
+            else{
+                current.block.swap(next);
+                current.pos = 0;
+                prefetch(r);
+                addHead(r);
+            }
+        }
+    }
+    size--;
+
+    // once no run is left the file can start over
+    if(live_runs == 0 && !files.empty()){
+        files.clear();
+        free_runs.clear();
+        end = 0;
+        if(ftruncate(fd, 0) != 0){
+            throw std::runtime_error("Could not truncate the spill file");
+        }
+    }
+}
+
+template <typename T, typename Priority, typename Compare>
+bool ExternalHeap<T, Priority, Compare>::isEmpty(){
+    if(size>0)
+        return false;
+    else
+        return true;
+}
+
+template <typename T, typename Priority, typename Compare>
+long long ExternalHeap<T, Priority, Compare>::runs() const{
+    return live_runs;
+}
+
+/* drains the buffer in order into a new run at the end of the file, first
+   merging runs if there are too many to add another. The first block is
+   kept from the drained records and only the rest is written. */
+template <typename T, typename Priority, typename Compare>
+void ExternalHeap<T, Priority, Compare>::spill(){
+    if(live_runs >= (long long)max_runs)
+        merge();
+
+    std::vector<record> sorted;
+    sorted.reserve(buffered);
+    while(!buffer.isEmpty()){
+        record next;
+        next.priority = buffer.peekPriority();
+        next.value = buffer.pop();
+        sorted.push_back(next);
+    }
+
+    size_t first = sorted.size() < block_records ? sorted.size() : block_records;
+    try{
+        writeRecords(sorted.data() + first, sorted.size() - first, end);
+    }
+    catch(...){
+        // put the items back so the heap is as it was
+        for(size_t i = 0; i < sorted.size(); i++)
+            buffer.add(sorted[i].value, sorted[i].priority);
+        throw;
+    }
+    buffered = 0;
+
+    off_t start = end;
+    end += (sorted.size() - first) * sizeof(record);
+    std::vector<record> block(sorted.begin(), sorted.begin() + first);
+    newRun(start, end, block, sorted.size() - first);
+}
+
+/* merges the smaller half of the runs, by records left, into one new run at
+   the end of the file. The runs are read through cursors of their own, so
+   if a read or write fails the heap is left as it was. */
+template <typename T, typename Priority, typename Compare>
+void ExternalHeap<T, Priority, Compare>::merge(){
+    std::vector<int> order;
+    for(size_t r = 0; r < files.size(); r++){
+        if(!files[r].block.empty())
+            order.push_back(r);
+    }
+    std::sort(order.begin(), order.end(), [this](int a, int b){
+        return remaining(files[a]) < remaining(files[b]);
+    });
+    size_t fan_in = max_runs / 2 < 2 ? 2 : max_runs / 2;
+    if(order.size() > fan_in)
+        order.resize(fan_in);
+
+    // a run's block in flight is read again by its cursor, so its memory
+    // goes to the merge
+    for(size_t i = 0; i < order.size(); i++)
+        unfetch(files[order[i]]);
+
+    struct cursor{
+        const std::vector<record> * block;
+        size_t pos;
+        std::vector<record> own;
+        off_t offset;
+        long long left;
+    };
+    std::vector<cursor> cursors(order.size());
+    head_heap merging;
+    for(size_t i = 0; i < order.size(); i++){
+        const run & input = files[order[i]];
+        cursors[i].block = &input.block;
+        cursors[i].pos = input.pos;
+        cursors[i].offset = input.offset;
+        cursors[i].left = input.left;
+        const record & head = input.block[input.pos];
+        merging.add(std::make_pair(head.value, (int)i), head.priority);
+    }
+
+    std::vector<record> first;
+    std::vector<record> out;
+    out.reserve(block_records);
+    off_t at = end;
+    long long total = 0;
+    while(!merging.isEmpty()){
+        int i = merging.peek().second;
+        cursor & c = cursors[i];
+        out.push_back((*c.block)[c.pos]);
+        total++;
+        merging.remove();
+        if(out.size() == block_records){
+            if(first.empty()){
+                first.swap(out);
+                out.reserve(block_records);
+            }
+            else{
+                writeRecords(out.data(), out.size(), at);
+                at += out.size() * sizeof(record);
+                out.clear();
+            }
+        }
+
+        c.pos++;
+        if(c.pos == c.block->size()){
+            if(c.left == 0)
+                continue;
+            size_t count = c.left < (long long)block_records ? c.left : block_records;
+            c.own = readBlock(fd, c.offset, count);
+            c.block = &c.own;
+            c.pos = 0;
+            c.offset += count * sizeof(record);
+            c.left -= count;
+        }
+        const record & next = (*c.block)[c.pos];
+        merging.add(std::make_pair(next.value, i), next.priority);
+    }
+    if(first.empty()){
+        first.swap(out);
+    }
+    else if(!out.empty()){
+        writeRecords(out.data(), out.size(), at);
+        at += out.size() * sizeof(record);
+    }
+
+    // everything is on disk, so now the inputs can give way to the result
+    for(size_t i = 0; i < order.size(); i++){
+        heads.erase(files[order[i]].head);
+        retire(order[i]);
+    }
+    off_t start = end;
+    end = at;
+    newRun(start, end, first, total - first.size());
+}
+
+/* sets up a run in a free slot, with first as its current block and left
+   records on disk from start on, and adds its head */
+template <typename T, typename Priority, typename Compare>
+int ExternalHeap<T, Priority, Compare>::newRun(off_t start, off_t stop, std::vector<record> & first, long long left){
+    int r;
+    if(free_runs.empty()){
+        files.emplace_back();
+        r = files.size() - 1;
+    }
+    else{
+        r = free_runs.back();
+        free_runs.pop_back();
+    }
+    run & current = files[r];
+    current.start = start;
+    current.stop = stop;
+    current.offset = start;
+    current.left = left;
+    current.block.swap(first);
+    current.pos = 0;
+    current.ahead_count = 0;
+    live_runs++;
+    addHead(r);
+    prefetch(r);
+    return r;
+}
+
+/* frees run r's memory, slot and, where the file system allows, its disk
+   space. The run must have no read in flight. */
+template <typename T, typename Priority, typename Compare>
+void ExternalHeap<T, Priority, Compare>::retire(int r){
+    run & current = files[r];
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if(current.stop > current.start){
+        if(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, current.start, current.stop - current.start) != 0){
+            // not supported here; the space comes back when the last run goes
+        }
+    }
+#endif
+    std::vector<record>().swap(current.block);
+    free_runs.push_back(r);
+    live_runs--;
+}
+
+template <typename T, typename Priority, typename Compare>
+void ExternalHeap<T, Priority, Compare>::addHead(int r){
+    const record & next = files[r].block[files[r].pos];
+    files[r].head = heads.add(std::make_pair(next.value, r), next.priority);
+}
+
+/* starts reading run r's next block in the background, if it has one. If
+   no thread can be started the block is read when it is needed instead. */
+template <typename T, typename Priority, typename Compare>
+void ExternalHeap<T, Priority, Compare>::prefetch(int r){
+    run & current = files[r];
+    if(current.left == 0)
+        return;
+    size_t count = current.left < (long long)block_records ? current.left : block_records;
+    try{
+        current.ahead = std::async(std::launch::async, &ExternalHeap::readBlock, fd, current.offset, count);
+    }
+    catch(const std::system_error &){
+        return;
+    }
+    current.ahead_count = count;
+    current.offset += count * sizeof(record);
+    current.left -= count;
+}
+
+/* waits out and drops the read in flight, putting its records back among
+   the unread ones */
+template <typename T, typename Priority, typename Compare>
+void ExternalHeap<T, Priority, Compare>::unfetch(run & current){
+    if(!current.ahead.valid())
+        return;
+    current.ahead.wait();
+    current.ahead = std::future<std::vector<record> >();
+    current.offset -= current.ahead_count * sizeof(record);
+    current.left += current.ahead_count;
+    current.ahead_count = 0;
+}
+
+/* returns the run's next block, from the read in flight or else read now,
+   or an empty one if the run is used up. If the read fails the records are
+   still unread and the next call tries them again. */
+template <typename T, typename Priority, typename Compare>
+std::vector<typename ExternalHeap<T, Priority, Compare>::record> ExternalHeap<T, Priority, Compare>::nextBlock(run & current){
+    if(current.ahead.valid()){
+        try{
+            std::vector<record> next = current.ahead.get();
+            current.ahead_count = 0;
+            return next;
+        }
+        catch(...){
+            current.offset -= current.ahead_count * sizeof(record);
+            current.left += current.ahead_count;
+            current.ahead_count = 0;
+            throw;
+        }
+    }
+    if(current.left == 0)
+        return std::vector<record>();
+    size_t count = current.left < (long long)block_records ? current.left : block_records;
+    std::vector<record> next = readBlock(fd, current.offset, count);
+    current.offset += count * sizeof(record);
+    current.left -= count;
+    return next;
+}
+
+template <typename T, typename Priority, typename Compare>
+long long ExternalHeap<T, Priority, Compare>::remaining(const run & current) const{
+    return (current.block.size() - current.pos) + current.ahead_count + current.left;
+}
+
+/* true when the buffer's top comes before the best run head */
+template <typename T, typename Priority, typename Compare>
+bool ExternalHeap<T, Priority, Compare>::fromBuffer() const{
+    if(buffered == 0)
+        return false;
+    if(live_runs == 0)
+        return true;
+    const Priority & a = buffer.peekPriority();
+    const Priority & b = heads.peekPriority();
+    if(cmp(a, b))
+        return true;
+    if(cmp(b, a))
+        return false;
+    return !(heads.peek().first < buffer.peek());
+}
+
+template <typename T, typename Priority, typename Compare>
+void ExternalHeap<T, Priority, Compare>::writeRecords(const record * data, size_t count, off_t at){
+    const char * bytes = reinterpret_cast<const char *>(data);
+    size_t total = count * sizeof(record);
+    size_t written = 0;
+    while(written < total){
+        ssize_t n = pwrite(fd, bytes + written, total - written, at + written);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0){
+            throw std::runtime_error("Could not write to the spill file");
+        }
+        written += n;
+    }
+}
+
+/* reads count records at offset; pread keeps concurrent reads of
+   different runs from disturbing each other */
+template <typename T, typename Priority, typename Compare>
+std::vector<typename ExternalHeap<T, Priority, Compare>::record> ExternalHeap<T, Priority, Compare>::readBlock(int fd, off_t offset, size_t count){
+    std::vector<record> block(count);
+    char * bytes = reinterpret_cast<char *>(block.data());
+    size_t total = count * sizeof(record);
+    size_t got = 0;
+    while(got < total){
+        ssize_t n = pread(fd, bytes + got, total - got, offset + got);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0){
+            throw std::runtime_error("Could not read from the spill file");
+        }
+        got += n;
+    }
+    return block;
+}
+
+#endif
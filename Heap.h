@@ -1,198 +1,830 @@
+#ifndef HEAP_H
+#define HEAP_H
+
 #include <iostream>
 #include <string>
 #include <cmath>
 #include <vector>
 #include <stdexcept>
 #include <exception>
+#include <utility>
+#include <new>
+#include <climits>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <type_traits>
+#include <algorithm>
+#include "LatencyHistogram.h"
+#include "MemoryUsage.h"
+// The SIMD child selection is opt-in: build with -DHEAP_SIMD plus -msse4.1
+// or -mavx2. It has not measured faster than the scalar loop (see minLanes).
+#if defined(HEAP_SIMD) && defined(__AVX2__)
+#define HEAP_SIMD_AVX2
+#endif
+#if defined(HEAP_SIMD) && (defined(__AVX2__) || defined(__SSE4_1__))
+#define HEAP_SIMD_SSE41
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
-template <typename T>
+/* allocator that starts every vector it backs on a 64-byte (cache line) boundary */
+template <typename U>
+struct CacheAligned {
+    typedef U value_type;
+
+    CacheAligned() {}
+    template <typename V>
+    CacheAligned(const CacheAligned<V> &) {}
+
+    U * allocate(size_t n){
+        char * raw = static_cast<char *>(::operator new(n * sizeof(U) + 64 + sizeof(void *)));
+        uintptr_t aligned = (reinterpret_cast<uintptr_t>(raw) + sizeof(void *) + 63) & ~uintptr_t(63);
+        reinterpret_cast<void **>(aligned)[-1] = raw;
+        return reinterpret_cast<U *>(aligned);
+    }
+    void deallocate(U * p, size_t){
+        ::operator delete(reinterpret_cast<void **>(p)[-1]);
+    }
+    template <typename V>
+    bool operator==(const CacheAligned<V> &) const { return true; }
+    template <typename V>
+    bool operator!=(const CacheAligned<V> &) const { return false; }
+};
+
+/* SIMD kernels for MinHeap::minChild. Each takes an aligned block of d
+   child priorities and returns a bitmask of the lanes holding the smallest
+   one, or 0 when there is no kernel for that d and priority type, in which
+   case the caller scans the block itself.
+
+   They are compiled in only with HEAP_SIMD. In 5 runs each of 3 passes of
+   5M pop+push over 4M items, every configuration a kernel covers had a
+   slower median than the scalar build (D=4 int with SSE4.1: 3.49 s
+   against 2.81 s; D=8 int with AVX2: 3.22 s against 2.62 s), and the
+   spread within one build (2.0 to 4.1 s for D=4 int scalar) was larger
+   than any gap between builds. The sift waits on cache misses for the
+   child block, not on the compares. */
+template <typename P>
+inline unsigned minLanes(const P *, int){
+    return 0;
+}
+
+inline unsigned minLanes(const int * block, int d){
+    (void)block;
+    (void)d;
+#if defined(HEAP_SIMD_AVX2)
+    if(d == 8){
+        __m256i v = _mm256_load_si256(reinterpret_cast<const __m256i *>(block));
+        __m256i m = _mm256_min_epi32(v, _mm256_permute2x128_si256(v, v, 1));
+        m = _mm256_min_epi32(m, _mm256_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+        m = _mm256_min_epi32(m, _mm256_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, m)));
+    }
+#endif
+#if defined(HEAP_SIMD_SSE41)
+    if(d == 4){
+        __m128i v = _mm_load_si128(reinterpret_cast<const __m128i *>(block));
+        __m128i m = _mm_min_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+        m = _mm_min_epi32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, m)));
+    }
+#endif
+    return 0;
+}
+
+#if defined(HEAP_SIMD_AVX2)
+/* AVX2 has no 64-bit min, so compare and blend. Unsigned values are
+   compared with their sign bits flipped, which the caller passes as bias. */
+inline unsigned minLanes64(const void * block, int d, long long bias){
+    const __m256i flip = _mm256_set1_epi64x(bias);
+    __m256i a = _mm256_xor_si256(_mm256_load_si256(reinterpret_cast<const __m256i *>(block)), flip);
+    __m256i b = a;
+    if(d == 8)
+        b = _mm256_xor_si256(_mm256_load_si256(reinterpret_cast<const __m256i *>(block) + 1), flip);
+    __m256i m = _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi64(a, b));
+    __m256i r = _mm256_permute4x64_epi64(m, _MM_SHUFFLE(1, 0, 3, 2));
+    m = _mm256_blendv_epi8(m, r, _mm256_cmpgt_epi64(m, r));
+    r = _mm256_permute4x64_epi64(m, _MM_SHUFFLE(2, 3, 0, 1));
+    m = _mm256_blendv_epi8(m, r, _mm256_cmpgt_epi64(m, r));
+    unsigned mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(a, m)));
+    if(d == 8)
+        mask |= _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(b, m))) << 4;
+    return mask;
+}
+#endif
+
+inline unsigned minLanes(const int64_t * block, int d){
+    (void)block;
+    (void)d;
+#if defined(HEAP_SIMD_AVX2)
+    if(d == 4 || d == 8)
+        return minLanes64(block, d, 0);
+#endif
+    return 0;
+}
+
+inline unsigned minLanes(const uint64_t * block, int d){
+    (void)block;
+    (void)d;
+#if defined(HEAP_SIMD_AVX2)
+    if(d == 4 || d == 8)
+        return minLanes64(block, d, LLONG_MIN);
+#endif
+    return 0;
+}
+
+template <typename T, int D = 0, typename Priority = int, typename Compare = std::less<Priority> >
 class MinHeap {
     public:
-        MinHeap (int x);
+        typedef int64_t handle;
+        /* a handle is a slot number in its low 32 bits and the generation
+           of that slot above them. A slot's generation goes up every time
+           its item leaves the heap, so a handle kept after its item left
+           is rejected even once the slot holds a new item. */
+
+        MinHeap (int x = D);
         /* Constructor that builds a d-ary Min Heap
-          This should work for any d >= 2,
-          but doesn't have to do anything for smaller d.*/
+          This should work for any d >= 2, and throws
+          std::invalid_argument for smaller d, so MinHeap<T> needs an
+          arity either as D or as x.
+          When D is given as a template argument it is used instead of x,
+          so the index arithmetic is done on a constant (shifts for powers
+          of two). Priorities can be any type Compare orders, e.g. uint64_t,
+          double or a std::tuple. */
+
+        template <typename Iterator>
+        MinHeap (Iterator first, Iterator last, int x = D);
+        /* Constructor that builds the heap from a range of (item, priority)
+           pairs in O(n), as if by add_bulk. The handles are 0 to n-1 in
+           the order of the range. */
 
         ~MinHeap ();
 
-        int add (T item, int priority);
+        MinHeap (const MinHeap & other) = delete;
+        MinHeap & operator= (const MinHeap & other) = delete;
+
+        handle add (T item, Priority priority);
          /* adds the item to the heap, with the given priority. 
             multiple identical items can be in the heap simultaneously. 
-            Returns the number of times add has been called prior to this
-            call (for use with the update function).*/
+            Returns a handle for the item (for use with the update and
+            erase functions). The handle is only valid while its item is
+            in the heap.*/
+
+        template <typename... Args>
+        handle emplace (Priority priority, Args&&... args);
+         /* like add, but constructs the item in place from args, so T
+            does not have to be copyable. */
+
+        template <typename Iterator>
+        std::pair<handle, handle> add_bulk (Iterator first, Iterator last);
+         /* adds every (item, priority) pair in [first, last). Returns the
+            range [first, second) of handles given to them, in the order of
+            the range. When the heap was empty or the batch is big enough
+            that sifting each item up could cost more than rebuilding, the
+            heap is rebuilt bottom-up (Floyd) in O(n) instead. */
 
         const T & peek () const;
          /* returns the element with smallest priority.  
             If two elements have the same priority, use operator< on the 
             T data, and return the one with smaller data.*/
 
+        const Priority & peekPriority () const;
+         /* returns the priority of the element peek returns. */
+
         void remove ();
          /* removes the element with smallest priority, with the same tie-breaker
             as peek. */
 
-        void update (int nth, int priority);
-         /* finds the nth item (where nth is 0-based) that has ever been added 
-            to the heap (the node that was created on the nth call to add), 
-            and updates its priority accordingly. */
+        T pop ();
+         /* removes the element with smallest priority like remove, and
+            returns it by moving it out of the heap. */
+
+        void update (handle h, Priority priority);
+         /* finds the item with the given handle and updates its priority
+            accordingly. Throws std::out_of_range if the handle is not in
+            the heap. */
+
+        void update_batch (const std::vector<handle> & handles, const std::vector<Priority> & priorities);
+         /* gives handles[i] the priority priorities[i] for every i. Small
+            batches are sifted one by one. Large ones first write every
+            priority, then re-heapify only the subtrees above the changed
+            positions, bottom-up. The heap is valid again on return.
+            Throws std::out_of_range if any handle is not in the heap (and
+            then changes nothing), or std::invalid_argument if the vectors
+            differ in length. */
+
+        void erase (handle h);
+         /* removes the item with the given handle from the heap, wherever
+            it is. Throws std::out_of_range if the handle is not in the heap. */
 
         bool isEmpty ();
          /* returns true iff there are no elements on the heap. */
 
+        void set_capacity (int k);
+         /* turns on top-k mode: offer keeps at most k elements, the k that
+            come last in the heap's order, so the root is the worst one
+            kept. Use Compare = std::greater to keep the k smallest
+            priorities. If more than k elements are in the heap, the ones
+            at the top are removed. k = 0 turns the mode off. Throws
+            std::invalid_argument if k is negative. add and emplace still
+            ignore the capacity. */
+
+        bool offer (T item, Priority priority);
+         /* adds the item if the heap is below capacity (or has none).
+            When it is full, an item that would not come after the root
+            is rejected in O(1) and the heap is not touched. Otherwise the
+            item replaces the root with a single trickle down. Returns
+            whether the item was kept. No handle is returned, because
+            kept items can later be pushed out. */
+
+        std::vector<T> drain_sorted ();
+         /* empties the heap and returns its items from the one that comes
+            last in heap order to the one at the root, so the best element
+            of a top-k heap is first. */
+
+        void merge_top (MinHeap & other);
+         /* offers every element of other to this heap, leaving other
+            empty. With both heaps in top-k mode this merges per-thread
+            top-k results. */
+
+        MemoryUsage memory_usage () const;
+         /* returns how much heap memory the heap holds: the items and
+            priorities in it, the handle and position tables, unused
+            capacity and free slab slots, and malloc's own overhead. */
+
+        void shrink_to_fit ();
+         /* gives back memory the heap no longer needs: spare capacity,
+            trailing handles that are no longer in use, and the slab
+            chunks behind them. Handles still in the heap keep their
+            numbers, so free handles below the highest live one stay. */
+
         void trickleup(int pos);
 
         void trickledown(int pos);
 
+#ifdef TREES_LATENCY
+        HeapLatency & latency () const { return mLatency; }
+         /* returns the latency histograms for add, remove (and pop) and
+            update. Only present when built with TREES_LATENCY. */
+#endif
+
    private:
         // whatever you need to naturally store things.
         // You may also add helper functions here.
-        struct data{
-            int priority;
-            int index;
-            int id;
-            T value;
-        };
 
-        void swap(int pos1, int pos2);
+        // the heap is kept as two parallel arrays, priorities and handles, so
+        // sifting never touches the items. The items live in a slab indexed by
+        // handle, in chunks that never move once allocated.
+        //
+        // prio is cache-line aligned and shifted by d-1 slots, which puts the
+        // children of node pos at prio[d*(pos+1)], a multiple of d. Each node's
+        // children therefore share one aligned block (one cache line when
+        // d*sizeof(Priority) is 64) and can be compared with a single SIMD load.
+        // Slots past the end always hold the largest priority so a full block
+        // can be read.
+        static const int SLAB_CHUNK = 1024;
+
+        int arity() const { return D ? D : d; }
+        static Priority sentinel();
+        bool before(const Priority & priority1, int id1, const Priority & priority2, int id2) const;
+        int minChild(int pos) const;
+        int acquire(bool fresh = false);
+        void heapify();
+        int depth() const;
+        void release(int id);
+        handle handleOf(int id) const;
+        int checkHandle(handle h) const;
+        void popRoot();
+        void place(int pos, const Priority & priority, int id);
+        T * slot(int id) const;
 
-        std::vector<data> heap;
-        std::vector<data> id_holder;
+        std::vector<Priority, CacheAligned<Priority> > prio;
+        std::vector<int> ids;
+        std::vector<char *> slab;
+        // heap position of each slot, or -1 once its item has left the heap
+        std::vector<int> id_holder;
+        // generation of each slot, and the one new slots start at, which is
+        // above that of any slot shrink_to_fit dropped
+        std::vector<uint32_t> gens;
+        uint32_t fresh_gen;
+        // slots that can be given out again
+        std::vector<int> free_ids;
+        // scratch marks for update_batch, one per heap position
+        std::vector<char> dirty;
         int size;
         int d;
-        int count;
+        int base;
+        // top-k bound for offer, or 0 for none
+        int capacity;
+        Compare cmp;
+#ifdef TREES_LATENCY
+        mutable HeapLatency mLatency;
+#endif
 };
 
-template <typename T>
-MinHeap<T>::MinHeap(int x){
-    this->d = x;
+template <typename T, int D, typename Priority, typename Compare>
+MinHeap<T, D, Priority, Compare>::MinHeap(int x){
+    static_assert(D == 0 || D >= 2, "MinHeap needs an arity of at least 2");
+    this->d = D ? D : x;
+    if(arity() < 2){
+        throw std::invalid_argument("Arity must be at least 2");
+    }
     size = 0;
-    count = 0;
+    capacity = 0;
+    fresh_gen = 0;
+    base = arity() - 1;
+    prio.assign(base + arity(), sentinel());
 }
 
-template <typename T>
-MinHeap<T>::~MinHeap(){
+template <typename T, int D, typename Priority, typename Compare>
+template <typename Iterator>
+MinHeap<T, D, Priority, Compare>::MinHeap(Iterator first, Iterator last, int x)
+    : MinHeap(x){
+    add_bulk(first, last);
+}
 
+template <typename T, int D, typename Priority, typename Compare>
+MinHeap<T, D, Priority, Compare>::~MinHeap(){
+    for(int i = 0; i < size; i++){
+        slot(ids[i])->~T();
+    }
+    for(size_t i = 0; i < slab.size(); i++){
+        ::operator delete(slab[i]);
+    }
+}
+
+template <typename T, int D, typename Priority, typename Compare>
+typename MinHeap<T, D, Priority, Compare>::handle MinHeap<T, D, Priority, Compare>::add(T item, Priority priority){
+    return emplace(priority, std::move(item));
 }
 
-template <typename T>
-int MinHeap<T>::add(T item, int priority){
+template <typename T, int D, typename Priority, typename Compare>
+template <typename... Args>
+typename MinHeap<T, D, Priority, Compare>::handle MinHeap<T, D, Priority, Compare>::emplace(Priority priority, Args&&... args){
+    TREES_LATENCY_SCOPE(mLatency.add);
+    int id = acquire();
+    new (slot(id)) T(std::forward<Args>(args)...);
 
-    data next;
-    next.value = item;
-    next.priority = priority;
-    next.id = count++;
     size++;
-    heap.push_back(next);
-    id_holder.push_back(next);
+    ids.push_back(id);
+    while((int)prio.size() < base + size + arity()){
+        prio.push_back(sentinel());
+    }
+    place(size-1, priority, id);
     trickleup(size-1);
-    return count-1;
+    return handleOf(id);
 }
 
-template <typename T>
-const T & MinHeap<T>::peek() const{
+template <typename T, int D, typename Priority, typename Compare>
+template <typename Iterator>
+std::pair<typename MinHeap<T, D, Priority, Compare>::handle, typename MinHeap<T, D, Priority, Compare>::handle>
+MinHeap<T, D, Priority, Compare>::add_bulk(Iterator first, Iterator last){
+    int old_size = size;
+    // fresh slots all start at fresh_gen, so the handles are consecutive
+    handle first_handle = ((handle)fresh_gen << 32) | id_holder.size();
+    for(; first != last; ++first){
+        // fresh handles only, so the batch gets a consecutive range
+        int id = acquire(true);
+        new (slot(id)) T(first->first);
+        size++;
+        ids.push_back(id);
+        while((int)prio.size() < base + size + arity()){
+            prio.push_back(sentinel());
+        }
+        place(size-1, first->second, id);
+    }
+
+    // sifting k items up costs up to k levels each, rebuilding costs O(size)
+    int added = size - old_size;
+    if(old_size == 0 || (long long)added * depth() > size){
+        heapify();
+    }
+    else{
+        for(int pos = old_size; pos < size; pos++)
+            trickleup(pos);
+    }
+    return std::make_pair(first_handle, ((handle)fresh_gen << 32) | id_holder.size());
+}
+
+template <typename T, int D, typename Priority, typename Compare>
+const T & MinHeap<T, D, Priority, Compare>::peek() const{
     if(size == 0){
         throw std::out_of_range("Index is out of range");
     }
     else{
-        return heap[0].value;
+        return *slot(ids[0]);
     }
 }
 
-template <typename T>
-void MinHeap<T>::remove(){
+template <typename T, int D, typename Priority, typename Compare>
+const Priority & MinHeap<T, D, Priority, Compare>::peekPriority() const{
     if(size == 0){
         throw std::out_of_range("Index is out of range");
     }
     else{
-        heap[0] = heap[size-1];
-        heap[0].index = 0;
-        id_holder[heap[0].id].index = 0;
-        heap.pop_back();
-        trickledown(0);  
-        size--;  
+        return prio[base];
     }
 }
 
-template <typename T>
-void MinHeap<T>::update(int n, int priority){
-    int x = id_holder[n].priority;
-    if(x < priority){
-        id_holder[n].priority = priority;
-        heap[id_holder[n].index].priority = priority;
-        trickledown(id_holder[n].index);
+template <typename T, int D, typename Priority, typename Compare>
+void MinHeap<T, D, Priority, Compare>::remove(){
+    TREES_LATENCY_SCOPE(mLatency.remove);
+    if(size == 0){
+        throw std::out_of_range("Index is out of range");
     }
     else{
-        id_holder[n].priority = priority;
-        heap[id_holder[n].index].priority = priority;
-        trickleup(id_holder[n].index);
+        slot(ids[0])->~T();
+        popRoot();
+    }
+}
+
+template <typename T, int D, typename Priority, typename Compare>
+T MinHeap<T, D, Priority, Compare>::pop(){
+    TREES_LATENCY_SCOPE(mLatency.remove);
+    if(size == 0){
+        throw std::out_of_range("Index is out of range");
+    }
+    T * top = slot(ids[0]);
+    T item(std::move(*top));
+    top->~T();
+    popRoot();
+    return item;
+}
+
+template <typename T, int D, typename Priority, typename Compare>
+void MinHeap<T, D, Priority, Compare>::update(handle h, Priority priority){
+    TREES_LATENCY_SCOPE(mLatency.update);
+    int n = checkHandle(h);
+    int pos = id_holder[n];
+    Priority x = prio[base + pos];
+    prio[base + pos] = priority;
+    if(cmp(x, priority)){
+        trickledown(pos);
+    }
+    else{
+        trickleup(pos);
+    }
+}
+
+template <typename T, int D, typename Priority, typename Compare>
+void MinHeap<T, D, Priority, Compare>::update_batch(const std::vector<handle> & handles, const std::vector<Priority> & priorities){
+    if(handles.size() != priorities.size()){
+        throw std::invalid_argument("Handles and priorities differ in length");
+    }
+    for(size_t i = 0; i < handles.size(); i++){
+        checkHandle(handles[i]);
+    }
+
+    // one sift per item costs up to k * depth, the marked re-heapify about
+    // the size of the heap. Random updates rarely sift all the way, so the
+    // switch is made once k * depth is about twice the size.
+    if((long long)handles.size() * depth() < 2LL * size){
+        for(size_t i = 0; i < handles.size(); i++){
+            update(handles[i], priorities[i]);
+        }
+        return;
+    }
+
+    // mark every changed position and its ancestors; a walk stops at the
+    // first ancestor some earlier walk already marked
+    dirty.assign(size, 0);
+    for(size_t i = 0; i < handles.size(); i++){
+        int pos = id_holder[(int)(handles[i] & 0xffffffff)];
+        prio[base + pos] = priorities[i];
+        while(!dirty[pos]){
+            dirty[pos] = 1;
+            if(pos == 0)
+                break;
+            pos = (pos-1)/arity();
+        }
+    }
+    // children come after their parents, so going backwards every subtree
+    // below a marked node is a heap by the time it is sifted (as in Floyd)
+    for(int pos = size-1; pos >= 0; pos--){
+        if(dirty[pos])
+            trickledown(pos);
+    }
+}
+
+template <typename T, int D, typename Priority, typename Compare>
+void MinHeap<T, D, Priority, Compare>::erase(handle h){
+    int n = checkHandle(h);
+    int pos = id_holder[n];
+    slot(n)->~T();
+    release(n);
+    size--;
+    if(pos != size){
+        place(pos, prio[base + size], ids[size]);
+    }
+    prio[base + size] = sentinel();
+    ids.pop_back();
+    if(pos < size){
+        trickleup(pos);
+        trickledown(pos);
     }
 }
 
-template <typename T>
-bool MinHeap<T>::isEmpty(){
+template <typename T, int D, typename Priority, typename Compare>
+bool MinHeap<T, D, Priority, Compare>::isEmpty(){
     if(size>0)
         return false;
     else
         return true;
 }
 
-template <typename T>
-void MinHeap<T>::trickleup(int pos){
-    int parent = (pos-1)/d;
-    
-    if(heap[pos].priority < heap[parent].priority){
-        swap(parent, pos);
-        trickleup(parent);
+template <typename T, int D, typename Priority, typename Compare>
+void MinHeap<T, D, Priority, Compare>::set_capacity(int k){
+    if(k < 0){
+        throw std::invalid_argument("Capacity must not be negative");
     }
-    else if(heap[pos].priority == heap[parent].priority){
-        if(heap[pos].value < heap[parent].value){
-            swap(parent, pos);
-            trickleup(parent);
-        }
+    capacity = k;
+    while(capacity > 0 && size > capacity){
+        remove();
     }
 }
 
-template <typename T>
-void MinHeap<T>::trickledown(int pos){
-    if(pos >= size-1){
-        return;
+template <typename T, int D, typename Priority, typename Compare>
+bool MinHeap<T, D, Priority, Compare>::offer(T item, Priority priority){
+    if(capacity == 0 || size < capacity){
+        add(std::move(item), priority);
+        return true;
     }
-    if(pos * d + 1 >= size - 1){
+    // the root is the boundary of the kept set; only a later item gets in
+    const Priority & boundary = prio[base];
+    if(cmp(priority, boundary))
+        return false;
+    if(!cmp(boundary, priority) && !(*slot(ids[0]) < item))
+        return false;
+
+    int old = ids[0];
+    slot(old)->~T();
+    release(old);
+    int id = acquire();
+    new (slot(id)) T(std::move(item));
+    place(0, priority, id);
+    trickledown(0);
+    return true;
+}
+
+template <typename T, int D, typename Priority, typename Compare>
+std::vector<T> MinHeap<T, D, Priority, Compare>::drain_sorted(){
+    std::vector<T> items;
+    items.reserve(size);
+    while(size > 0){
+        items.push_back(pop());
+    }
+    std::reverse(items.begin(), items.end());
+    return items;
+}
+
+template <typename T, int D, typename Priority, typename Compare>
+void MinHeap<T, D, Priority, Compare>::merge_top(MinHeap & other){
+    if(&other == this)
         return;
+    while(other.size > 0){
+        Priority priority = other.peekPriority();
+        offer(other.pop(), priority);
+    }
+}
+
+template <typename T, int D, typename Priority, typename Compare>
+MemoryUsage MinHeap<T, D, Priority, Compare>::memory_usage() const{
+    MemoryUsage usage;
+    usage.payload = size * (sizeof(T) + sizeof(Priority));
+
+    // prio: the d-1 offset and the sentinels past the end are overhead, and
+    // CacheAligned's alignment padding counts with malloc's
+    usage.overhead += (prio.size() - size) * sizeof(Priority);
+    usage.slack += (prio.capacity() - prio.size()) * sizeof(Priority);
+    if(prio.capacity() > 0){
+        size_t requested = prio.capacity() * sizeof(Priority) + 64 + sizeof(void *);
+        const void * raw = reinterpret_cast<void * const *>(prio.data())[-1];
+        usage.allocator += requested - prio.capacity() * sizeof(Priority) + allocatorOverhead(raw, requested);
+    }
+
+    addVectorUsage(usage, ids);
+    addVectorUsage(usage, id_holder);
+    addVectorUsage(usage, gens);
+    addVectorUsage(usage, free_ids);
+    addVectorUsage(usage, dirty);
+    addVectorUsage(usage, slab);
+    // slab slots that hold no item
+    usage.slack += (slab.size() * SLAB_CHUNK - size) * sizeof(T);
+    for(size_t i = 0; i < slab.size(); i++){
+        usage.allocator += allocatorOverhead(slab[i], SLAB_CHUNK * sizeof(T));
+    }
+    return usage;
+}
+
+template <typename T, int D, typename Priority, typename Compare>
+void MinHeap<T, D, Priority, Compare>::shrink_to_fit(){
+    int keep = id_holder.size();
+    while(keep > 0 && id_holder[keep-1] < 0){
+        keep--;
+    }
+    // slots dropped here may be created again later, so they must come
+    // back with a generation none of their old handles has
+    for(size_t i = keep; i < gens.size(); i++){
+        fresh_gen = std::max(fresh_gen, (gens[i] + 1) & 0x7fffffff);
+    }
+    id_holder.resize(keep);
+    gens.resize(keep);
+    int kept = 0;
+    for(size_t i = 0; i < free_ids.size(); i++){
+        if(free_ids[i] < keep)
+            free_ids[kept++] = free_ids[i];
+    }
+    free_ids.resize(kept);
+
+    size_t chunks = (keep + SLAB_CHUNK - 1) / SLAB_CHUNK;
+    for(size_t i = chunks; i < slab.size(); i++){
+        ::operator delete(slab[i]);
+    }
+    slab.resize(chunks);
+
+    prio.resize(base + size + arity());
+    prio.shrink_to_fit();
+    ids.shrink_to_fit();
+    id_holder.shrink_to_fit();
+    gens.shrink_to_fit();
+    free_ids.shrink_to_fit();
+    slab.shrink_to_fit();
+    dirty.clear();
+    dirty.shrink_to_fit();
+}
+
+/* moves the entry at pos up by shifting larger parents down into the
+   hole, and writes it once where it stops */
+template <typename T, int D, typename Priority, typename Compare>
+void MinHeap<T, D, Priority, Compare>::trickleup(int pos){
+    Priority priority = prio[base + pos];
+    int id = ids[pos];
+    while(pos > 0){
+        int parent = (pos-1)/arity();
+        if(!before(priority, id, prio[base + parent], ids[parent]))
+            break;
+        place(pos, prio[base + parent], ids[parent]);
+        pos = parent;
     }
+    place(pos, priority, id);
+}
 
-    int initial = d*pos+1;
-    int min;
-    for(int i = 1; i <= d; i++){
-        if(pos * d + i < size){
-            min = pos * d + i;
-            if(heap[initial].priority > heap[min].priority)
-                initial = min;
-            else if(heap[initial].priority == heap[min].priority){
-                if(heap[initial].value > heap[min].value)
-                    initial = min;
-            }
+/* moves the entry at pos down by shifting the smallest child up into the
+   hole, and writes it once where it stops */
+template <typename T, int D, typename Priority, typename Compare>
+void MinHeap<T, D, Priority, Compare>::trickledown(int pos){
+    Priority priority = prio[base + pos];
+    int id = ids[pos];
+    while(pos * arity() + 1 < size){
+        int initial = minChild(pos);
+        if(!before(prio[base + initial], ids[initial], priority, id))
+            break;
+        place(pos, prio[base + initial], ids[initial]);
+        pos = initial;
+    }
+    place(pos, priority, id);
+}
+
+/* finds the smallest child of pos, which must have at least one. Under
+   HEAP_SIMD with the default comparator, int and 64-bit priorities find
+   the smallest priority
+   in the child block with one SIMD min (see minLanes); only children tied
+   on it fall back to comparing items. */
+template <typename T, int D, typename Priority, typename Compare>
+int MinHeap<T, D, Priority, Compare>::minChild(int pos) const{
+    int first = arity()*pos+1;
+    int count = size - first < arity() ? size - first : arity();
+    const Priority * block = &prio[base + first];
+
+    unsigned mask = 0;
+    if(std::is_same<Compare, std::less<Priority> >::value)
+        mask = minLanes(block, arity());
+    if(mask != 0){
+        mask &= (1u << count) - 1;
+        int initial = first + __builtin_ctz(mask);
+        for(int i = __builtin_ctz(mask) + 1; i < count; i++){
+            if((mask & (1u << i)) && before(block[i], ids[first + i], prio[base + initial], ids[initial]))
+                initial = first + i;
         }
+        return initial;
     }
 
-    if(initial == pos)
-        return;
-    else{
-        swap(pos, initial);
-        trickledown(initial);
+    int initial = first;
+    for(int i = 1; i < count; i++){
+        if(before(block[i], ids[first + i], prio[base + initial], ids[initial]))
+            initial = first + i;
     }
+    return initial;
 }
 
-template <typename T>
-void MinHeap<T>::swap(int pos1, int pos2){
-    data swap_temp = heap[pos1];
-    heap[pos1] = heap[pos2];
-    heap[pos2] = swap_temp;
+/* restores the heap property over the whole array bottom-up (Floyd), which
+   is O(n) since most nodes sit near the bottom and sift only a little */
+template <typename T, int D, typename Priority, typename Compare>
+void MinHeap<T, D, Priority, Compare>::heapify(){
+    for(int pos = (size-2)/arity(); pos >= 0 && size > 1; pos--)
+        trickledown(pos);
+}
 
-    heap[pos1].index = pos1;
-    heap[pos2].index = pos2;
+/* number of levels in the heap */
+template <typename T, int D, typename Priority, typename Compare>
+int MinHeap<T, D, Priority, Compare>::depth() const{
+    int levels = 1;
+    for(long long reach = arity(); reach < size; reach *= arity())
+        levels++;
+    return levels;
+}
 
-    id_holder[heap[pos1].id].index = pos1;
-    id_holder[heap[pos2].id].index = pos2;
+/* takes the root entry out of the heap once its item has been destroyed */
+template <typename T, int D, typename Priority, typename Compare>
+void MinHeap<T, D, Priority, Compare>::popRoot(){
+    release(ids[0]);
+    size--;
+    if(size > 0){
+        place(0, prio[base + size], ids[size]);
+    }
+    prio[base + size] = sentinel();
+    ids.pop_back();
+    if(size > 0)
+        trickledown(0);
 }
+
+/* writes an entry to a heap position and records where its handle went */
+template <typename T, int D, typename Priority, typename Compare>
+void MinHeap<T, D, Priority, Compare>::place(int pos, const Priority & priority, int id){
+    prio[base + pos] = priority;
+    ids[pos] = id;
+    id_holder[id] = pos;
+}
+
+/* orders by priority, breaking ties with operator< on the data */
+template <typename T, int D, typename Priority, typename Compare>
+bool MinHeap<T, D, Priority, Compare>::before(const Priority & priority1, int id1, const Priority & priority2, int id2) const{
+    if(cmp(priority1, priority2))
+        return true;
+    if(cmp(priority2, priority1))
+        return false;
+    return *slot(id1) < *slot(id2);
+}
+
+/* filler for the slots past the end of the heap. Only the SIMD kernels read
+   it, and they only run for numeric priorities ordered by std::less. */
+template <typename T, int D, typename Priority, typename Compare>
+Priority MinHeap<T, D, Priority, Compare>::sentinel(){
+    if(std::numeric_limits<Priority>::is_specialized)
+        return std::numeric_limits<Priority>::max();
+    return Priority();
+}
+
+/* the slab storage for a handle's item */
+template <typename T, int D, typename Priority, typename Compare>
+T * MinHeap<T, D, Priority, Compare>::slot(int id) const{
+    return reinterpret_cast<T *>(slab[id / SLAB_CHUNK]) + id % SLAB_CHUNK;
+}
+
+/* hands out a free handle, growing the handle table and slab if needed.
+   A fresh handle is always a new one past the end of the table. */
+template <typename T, int D, typename Priority, typename Compare>
+int MinHeap<T, D, Priority, Compare>::acquire(bool fresh){
+    if(!fresh && !free_ids.empty()){
+        int id = free_ids.back();
+        free_ids.pop_back();
+        return id;
+    }
+    int id = id_holder.size();
+    id_holder.push_back(-1);
+    gens.push_back(fresh_gen);
+    if(id / SLAB_CHUNK >= (int)slab.size()){
+        slab.push_back(static_cast<char *>(::operator new(SLAB_CHUNK * sizeof(T))));
+    }
+    return id;
+}
+
+/* marks a slot as no longer in the heap so add can hand it out again, and
+   moves it to a new generation so its old handle stops working. Generations
+   stay below 2^31 so handles are never negative. */
+template <typename T, int D, typename Priority, typename Compare>
+void MinHeap<T, D, Priority, Compare>::release(int id){
+    id_holder[id] = -1;
+    gens[id] = (gens[id] + 1) & 0x7fffffff;
+    free_ids.push_back(id);
+}
+
+/* the handle for the item now in a slot */
+template <typename T, int D, typename Priority, typename Compare>
+typename MinHeap<T, D, Priority, Compare>::handle MinHeap<T, D, Priority, Compare>::handleOf(int id) const{
+    return ((handle)gens[id] << 32) | id;
+}
+
+/* returns the slot of a handle whose item is still in the heap, and throws
+   std::out_of_range for any other handle */
+template <typename T, int D, typename Priority, typename Compare>
+int MinHeap<T, D, Priority, Compare>::checkHandle(handle h) const{
+    long long id = h & 0xffffffff;
+    if(h < 0 || id >= (long long)id_holder.size() || id_holder[id] < 0 || (h >> 32) != gens[id]){
+        throw std::out_of_range("Handle is not in the heap");
+    }
+    return (int)id;
+}
+
+#endif
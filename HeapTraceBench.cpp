@@ -0,0 +1,208 @@
+/* Replays the same operation trace on MinHeap and PairingHeap and prints
+   how long each backend takes, to pick a priority queue for a workload.
+
+   Build and run from this directory with
+       g++ -std=c++17 -O2 -DNDEBUG HeapTraceBench.cpp -o HeapTraceBench
+       ./HeapTraceBench [items]
+   items defaults to 1000000.
+
+   A trace is recorded once off a 4-ary MinHeap and is then replayed on
+   every backend. Ties break on the item in both heaps, so every backend
+   must pop the items in the recorded order; a replay that does not is
+   reported as a mismatch. The meld workload cannot be written as a single
+   trace and runs the same steps on each backend instead. */
+
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <cstdio>
+#include <cstdlib>
+#include "Heap.h"
+#include "PairingHeap.h"
+
+struct TraceOp {
+    enum Kind { Add, Update, Pop };
+    Kind kind;
+    int item;
+    unsigned priority;
+};
+
+typedef MinHeap<int, 4, unsigned> RecordHeap;
+
+/* Dijkstra from node 0 over a random graph where each node has degree
+   random out-edges plus one to the next node, so every node is reached */
+std::vector<TraceOp> dijkstraTrace(int n, int degree, unsigned seed){
+    std::mt19937 rng(seed);
+    std::vector<std::vector<std::pair<int, unsigned> > > edges(n);
+    for(int i = 0; i < n; i++){
+        for(int k = 0; k < degree; k++)
+            edges[i].push_back(std::make_pair((int)(rng() % n), (unsigned)(rng() % 10000)));
+        edges[i].push_back(std::make_pair((i + 1) % n, (unsigned)(rng() % 10000)));
+    }
+
+    std::vector<TraceOp> trace;
+    RecordHeap heap;
+    std::vector<RecordHeap::handle> handles(n, -1);
+    std::vector<unsigned> dist(n, ~0u);
+    std::vector<char> done(n, 0);
+    dist[0] = 0;
+    handles[0] = heap.add(0, 0);
+    trace.push_back(TraceOp{TraceOp::Add, 0, 0});
+    while(!heap.isEmpty()){
+        int u = heap.pop();
+        trace.push_back(TraceOp{TraceOp::Pop, u, 0});
+        done[u] = 1;
+        for(size_t i = 0; i < edges[u].size(); i++){
+            int v = edges[u][i].first;
+            unsigned nd = dist[u] + edges[u][i].second;
+            if(done[v] || nd >= dist[v])
+                continue;
+            dist[v] = nd;
+            if(handles[v] < 0){
+                handles[v] = heap.add(v, nd);
+                trace.push_back(TraceOp{TraceOp::Add, v, nd});
+            }
+            else{
+                heap.update(handles[v], nd);
+                trace.push_back(TraceOp{TraceOp::Update, v, nd});
+            }
+        }
+    }
+    return trace;
+}
+
+/* n items, then rounds of k decrease-keys, each to a random priority
+   between the current minimum and the item's old one, followed by a pop */
+std::vector<TraceOp> decreaseTrace(int n, int k, int rounds, unsigned seed){
+    std::mt19937 rng(seed);
+    std::vector<TraceOp> trace;
+    RecordHeap heap;
+    std::vector<RecordHeap::handle> handles(n);
+    std::vector<unsigned> priorities(n);
+    // live items, and where each one sits in that list
+    std::vector<int> live;
+    std::vector<int> where(n);
+    for(int i = 0; i < n; i++){
+        priorities[i] = (rng() >> 2) + 1000000;
+        handles[i] = heap.add(i, priorities[i]);
+        trace.push_back(TraceOp{TraceOp::Add, i, priorities[i]});
+        where[i] = live.size();
+        live.push_back(i);
+    }
+    for(int r = 0; r < rounds && !live.empty(); r++){
+        unsigned low = heap.peekPriority();
+        for(int j = 0; j < k; j++){
+            int item = live[rng() % live.size()];
+            if(priorities[item] <= low)
+                continue;
+            priorities[item] = low + rng() % (priorities[item] - low);
+            heap.update(handles[item], priorities[item]);
+            trace.push_back(TraceOp{TraceOp::Update, item, priorities[item]});
+        }
+        int u = heap.pop();
+        trace.push_back(TraceOp{TraceOp::Pop, u, 0});
+        int last = live.back();
+        live[where[u]] = last;
+        where[last] = where[u];
+        live.pop_back();
+    }
+    return trace;
+}
+
+/* replays a trace and returns the time in milliseconds; mismatches counts
+   pops that did not return the recorded item */
+template <typename Heap, typename Handle>
+double replay(const std::vector<TraceOp> & trace, int n, Heap & heap, Handle none, long & mismatches){
+    std::vector<Handle> handles(n, none);
+    mismatches = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < trace.size(); i++){
+        const TraceOp & op = trace[i];
+        if(op.kind == TraceOp::Add){
+            handles[op.item] = heap.add(op.item, op.priority);
+        }
+        else if(op.kind == TraceOp::Update){
+            heap.update(handles[op.item], op.priority);
+        }
+        else{
+            if(heap.peek() != op.item)
+                mismatches++;
+            heap.remove();
+        }
+    }
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void runTrace(const char * name, const std::vector<TraceOp> & trace, int n){
+    long counts[3] = {0, 0, 0};
+    for(size_t i = 0; i < trace.size(); i++)
+        counts[trace[i].kind]++;
+
+    long bad4, bad2, badPairing;
+    MinHeap<int, 4, unsigned> heap4;
+    double time4 = replay(trace, n, heap4, (MinHeap<int, 4, unsigned>::handle)-1, bad4);
+    MinHeap<int, 2, unsigned> heap2;
+    double time2 = replay(trace, n, heap2, (MinHeap<int, 2, unsigned>::handle)-1, bad2);
+    PairingHeap<int, unsigned> pairing;
+    PairingHeap<int, unsigned>::handle none = {NULL, 0};
+    double timePairing = replay(trace, n, pairing, none, badPairing);
+
+    printf("%-26s %9ld %9ld %9ld %9.0f %9.0f %9.0f%s\n", name, counts[TraceOp::Add], counts[TraceOp::Update],
+        counts[TraceOp::Pop], time4, time2, timePairing, bad4 || bad2 || badPairing ? "  mismatch" : "");
+}
+
+/* fills queues of size items each, melds them pairwise down to one and
+   pops one item per original queue; returns the time in milliseconds and a
+   checksum of the pop order */
+template <typename Heap, typename Merge>
+double meldRun(int queues, int size, Merge merge, long long & checksum){
+    std::mt19937 rng(3);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<Heap *> heaps;
+    for(int q = 0; q < queues; q++){
+        heaps.push_back(new Heap());
+        for(int i = 0; i < size; i++)
+            heaps[q]->add(q * size + i, rng() >> 2);
+    }
+    for(int step = 1; step < queues; step *= 2){
+        for(int q = 0; q + step < queues; q += 2 * step){
+            merge(*heaps[q], *heaps[q + step]);
+        }
+    }
+    checksum = 0;
+    for(int q = 0; q < queues; q++){
+        checksum = checksum * 31 + heaps[0]->peek();
+        heaps[0]->remove();
+    }
+    for(int q = 0; q < queues; q++)
+        delete heaps[q];
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void runMeld(int queues, int size){
+    long long sum4, sumPairing;
+    double time4 = meldRun<MinHeap<int, 4, unsigned> >(queues, size,
+        [](MinHeap<int, 4, unsigned> & a, MinHeap<int, 4, unsigned> & b){ a.merge_top(b); }, sum4);
+    double timePairing = meldRun<PairingHeap<int, unsigned> >(queues, size,
+        [](PairingHeap<int, unsigned> & a, PairingHeap<int, unsigned> & b){ a.meld(b); }, sumPairing);
+    printf("meld %5d queues x %-6d %9d %9d %9d %9.0f %9s %9.0f%s\n", queues, size, queues * size, 0, queues,
+        time4, "-", timePairing, sum4 != sumPairing ? "  mismatch" : "");
+}
+
+int main(int argc, char ** argv){
+    int n = argc > 1 ? atoi(argv[1]) : 1000000;
+    printf("%-26s %9s %9s %9s %9s %9s %9s\n", "workload (times in ms)", "adds", "updates", "pops",
+        "MinHeap4", "MinHeap2", "pairing");
+    runTrace("dijkstra, degree 5", dijkstraTrace(n, 4, 1), n);
+    runTrace("dijkstra, degree 33", dijkstraTrace(n / 4, 32, 1), n / 4);
+    int ks[] = {4, 16, 64};
+    for(int i = 0; i < 3; i++){
+        char name[64];
+        snprintf(name, sizeof(name), "%d decrease-keys per pop", ks[i]);
+        runTrace(name, decreaseTrace(n, ks[i], n / ks[i] * 4, 2), n);
+    }
+    runMeld(1024, n / 1024);
+    runMeld(n / 16, 16);
+    return 0;
+}
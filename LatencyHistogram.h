@@ -0,0 +1,208 @@
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+/* Opt-in per-operation latency recording for the trees and MinHeap.
+   Build with -DTREES_LATENCY to turn it on. Each container then keeps a
+   histogram per operation, reachable through latency(). Without the flag
+   this header only defines TREES_LATENCY_SCOPE to expand to nothing, and
+   the containers carry no extra members, so the instrumentation costs
+   nothing.
+
+   Histograms are not thread-safe: recording is a plain read-modify-write.
+   Const calls count too, so finds that run concurrently under a shared
+   lock (as in ShardedTree) race on the find histogram. Measure with one
+   thread per container. */
+
+#ifdef TREES_LATENCY
+
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* a raw timestamp: the TSC where there is one, else steady_clock in ns */
+inline uint64_t latencyTicks(){
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+/* ticks per nanosecond, measured once against steady_clock */
+inline double latencyTicksPerNs(){
+#if defined(__x86_64__) || defined(__i386__)
+    static const double rate = [](){
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        uint64_t ticks = latencyTicks();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        uint64_t elapsed = latencyTicks() - ticks;
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        return elapsed / ns;
+    }();
+    return rate;
+#else
+    return 1.0;
+#endif
+}
+
+/* A log-linear (HDR-style) histogram of tick counts. Every power of two
+   is split into 32 equal sub-buckets, so a reported value is within about
+   3% of the recorded one, in fixed memory, over the whole 64-bit range.
+   Not thread-safe; see the top of this file. */
+class LatencyHistogram {
+    public:
+        LatencyHistogram ();
+
+        void record (uint64_t ticks);
+         /* adds one sample. */
+
+        long long count () const;
+         /* returns the number of samples. */
+
+        double percentile (double q) const;
+         /* returns the latency in ns that q percent of the samples do not
+            exceed, e.g. q = 99.9. Returns 0 when there are no samples. */
+
+        double max () const;
+         /* returns the largest sample in ns. */
+
+        void report (std::ostream & out, const std::string & name) const;
+         /* prints one line with the count, p50, p99, p99.9 and max. */
+
+        void clear ();
+
+    private:
+        static const int SUB_BITS = 5;
+        static const int SUB = 1 << SUB_BITS;
+        static const int BUCKETS = (64 - SUB_BITS + 1) * SUB;
+
+        static int bucketOf(uint64_t ticks);
+        static uint64_t upperEdge(int bucket);
+
+        uint64_t buckets[BUCKETS];
+        long long samples;
+        uint64_t largest;
+};
+
+inline LatencyHistogram::LatencyHistogram(){
+    clear();
+}
+
+inline void LatencyHistogram::record(uint64_t ticks){
+    buckets[bucketOf(ticks)]++;
+    samples++;
+    if(ticks > largest)
+        largest = ticks;
+}
+
+inline long long LatencyHistogram::count() const{
+    return samples;
+}
+
+inline double LatencyHistogram::percentile(double q) const{
+    if(samples == 0)
+        return 0;
+    long long rank = (long long)(q / 100.0 * samples + 0.5);
+    if(rank < 1)
+        rank = 1;
+    long long seen = 0;
+    for(int i = 0; i < BUCKETS; i++){
+        seen += buckets[i];
+        if(seen >= rank){
+            uint64_t edge = upperEdge(i);
+            return (edge < largest ? edge : largest) / latencyTicksPerNs();
+        }
+    }
+    return max();
+}
+
+inline double LatencyHistogram::max() const{
+    return largest / latencyTicksPerNs();
+}
+
+inline void LatencyHistogram::report(std::ostream & out, const std::string & name) const{
+    out << name << ": n=" << samples
+        << " p50=" << percentile(50) << "ns"
+        << " p99=" << percentile(99) << "ns"
+        << " p99.9=" << percentile(99.9) << "ns"
+        << " max=" << max() << "ns" << std::endl;
+}
+
+inline void LatencyHistogram::clear(){
+    std::memset(buckets, 0, sizeof(buckets));
+    samples = 0;
+    largest = 0;
+}
+
+/* values below SUB get a bucket each; above that, the top SUB_BITS bits
+   after the leading one pick the sub-bucket of the value's power of two */
+inline int LatencyHistogram::bucketOf(uint64_t ticks){
+    if(ticks < (uint64_t)SUB)
+        return ticks;
+    int exponent = 63 - __builtin_clzll(ticks);
+    int sub = (ticks >> (exponent - SUB_BITS)) & (SUB - 1);
+    return (exponent - SUB_BITS + 1) * SUB + sub;
+}
+
+inline uint64_t LatencyHistogram::upperEdge(int bucket){
+    if(bucket < SUB)
+        return bucket;
+    int exponent = bucket / SUB + SUB_BITS - 1;
+    uint64_t sub = bucket % SUB;
+    uint64_t low = (uint64_t(1) << exponent) | (sub << (exponent - SUB_BITS));
+    return low + (uint64_t(1) << (exponent - SUB_BITS)) - 1;
+}
+
+/* records the time between its construction and destruction */
+class LatencyScope {
+    public:
+        LatencyScope (LatencyHistogram & histogram) : target(histogram), start(latencyTicks()) {}
+        ~LatencyScope (){ target.record(latencyTicks() - start); }
+
+    private:
+        LatencyHistogram & target;
+        uint64_t start;
+};
+
+/* the histograms kept by each search tree */
+struct TreeLatency {
+    LatencyHistogram insert;
+    LatencyHistogram find;
+    LatencyHistogram remove;
+
+    void report (std::ostream & out) const{
+        insert.report(out, "insert");
+        find.report(out, "find");
+        remove.report(out, "remove");
+    }
+};
+
+/* the histograms kept by MinHeap */
+struct HeapLatency {
+    LatencyHistogram add;
+    LatencyHistogram remove;
+    LatencyHistogram update;
+
+    void report (std::ostream & out) const{
+        add.report(out, "add");
+        remove.report(out, "remove");
+        update.report(out, "update");
+    }
+};
+
+#define TREES_LATENCY_SCOPE(histogram) LatencyScope treesLatencyScope(histogram)
+
+#else
+
+#define TREES_LATENCY_SCOPE(histogram)
+
+#endif
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef MEMORYUSAGE_H
+#define MEMORYUSAGE_H
+
+#include <cstddef>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+/* A breakdown of the heap memory a container owns, as returned by
+   memory_usage(). Memory owned through pointers inside keys, values or
+   items (e.g. a std::string's buffer) is not followed. This counts what
+   the container holds from malloc, not the process's resident set: RSS
+   also moves with pages that are untouched, swapped out or kept by
+   malloc after a free, so the two are not meant to agree. */
+struct MemoryUsage {
+    // the stored keys and values, or items and priorities
+    size_t payload;
+    // what each element costs beyond its payload: vptrs, links, heights,
+    // handle tables, alignment padding
+    size_t overhead;
+    // memory that is allocated but holds nothing: spare vector capacity,
+    // free arena and slab space
+    size_t slack;
+    // malloc's own headers and size rounding, where the allocator can
+    // report it (glibc); 0 elsewhere
+    size_t allocator;
+
+    MemoryUsage () : payload(0), overhead(0), slack(0), allocator(0) {}
+
+    size_t total () const { return payload + overhead + slack + allocator; }
+};
+
+/* the bytes malloc spends on a block of the given size beyond the size
+   itself: the chunk header plus rounding up to its size classes */
+inline size_t allocatorOverhead(const void * block, size_t requested){
+#if defined(__GLIBC__)
+    if(block == NULL)
+        return 0;
+    return malloc_usable_size(const_cast<void *>(block)) + sizeof(size_t) - requested;
+#else
+    (void)block;
+    (void)requested;
+    return 0;
+#endif
+}
+
+/* counts a std::vector of bookkeeping: its elements as overhead, its
+   spare capacity as slack, and malloc's share of its buffer */
+template <typename V>
+inline void addVectorUsage(MemoryUsage & usage, const V & v){
+    size_t element = sizeof(typename V::value_type);
+    usage.overhead += v.size() * element;
+    usage.slack += (v.capacity() - v.size()) * element;
+    if(v.capacity() > 0)
+        usage.allocator += allocatorOverhead(v.data(), v.capacity() * element);
+}
+
+#endif
@@ -0,0 +1,131 @@
+/**
+* Checks memory_usage() against what malloc reports. For each container the memory malloc has
+* handed out (glibc's mallinfo2, counting both heap chunks and blocks big enough to get their own
+* mmap) is read before it is filled, and the growth since then must match
+* memory_usage().total() to within MARGIN_BYTES plus 0.1%, both after filling (and removing) and
+* again after shrink_to_fit(). Every mismatch is printed and the exit status is 1.
+*
+* Build and run from this directory with
+*     g++ -std=c++17 -O2 MemoryUsageCheck.cpp -o MemoryUsageCheck
+*     ./MemoryUsageCheck
+*
+* Sanitizers replace malloc and make mallinfo2 meaningless, so build without them. Other C
+* libraries have no mallinfo2 and the check does nothing there.
+*/
+
+#include <iostream>
+#include <vector>
+#include <random>
+#include <string>
+#include <cstdio>
+#include "AvlTree.h"
+#include "SplayTree.h"
+#include "ScapegoatTree.h"
+#include "Heap.h"
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+
+// room for the odd allocation the standard library makes along the way
+static const long long MARGIN_BYTES = 16384;
+
+long long heapInUse()
+{
+	struct mallinfo2 info = mallinfo2();
+	//shrink_to_fit's single arena is usually large enough to be mmapped, which uordblks leaves out
+	return info.uordblks + info.hblkhd;
+}
+
+/**
+* Prints one row and returns whether memory_usage() agrees with the heap growth since baseline.
+*/
+bool agrees(const std::string& name, const MemoryUsage& usage, long long baseline)
+{
+	long long grown = heapInUse() - baseline;
+	long long reported = usage.total();
+	long long off = grown > reported ? grown - reported : reported - grown;
+	bool good = off <= MARGIN_BYTES + reported / 1000;
+	std::printf("%-34s total %12lld  heap growth %12lld%s\n", name.c_str(), reported, grown, good ? "" : "  BROKEN");
+	return good;
+}
+
+/**
+* Fills a tree with count random keys, removes every other one when Thin is set, and compares
+* before and after shrink_to_fit(). The plain BST has no remove, hence the template parameter.
+*/
+template <class Tree, bool Thin>
+bool checkTree(const std::string& name, int count)
+{
+	std::vector<int> keys(count);
+	std::mt19937 rng(7);
+	for(int i = 0; i < count; i++){
+		keys[i] = rng();
+	}
+	long long baseline = heapInUse();
+	bool good = true;
+	{
+		Tree tree;
+		for(int i = 0; i < count; i++){
+			tree.insert(std::make_pair(keys[i], i));
+		}
+		if constexpr(Thin){
+			for(int i = 0; i < count; i += 2){
+				tree.remove(keys[i]);
+			}
+		}
+		good = agrees(name, tree.memory_usage(), baseline) && good;
+		tree.shrink_to_fit();
+		good = agrees(name + ", shrunk", tree.memory_usage(), baseline) && good;
+	}
+	return good;
+}
+
+/**
+* Fills a 4-ary MinHeap, erases all but every tenth item, and compares at each step.
+*/
+bool checkHeap(int count)
+{
+	std::vector<MinHeap<int>::handle> handles(count);
+	long long baseline = heapInUse();
+	bool good = true;
+	{
+		MinHeap<int> heap(4);
+		std::mt19937 rng(7);
+		for(int i = 0; i < count; i++){
+			handles[i] = heap.add(i, rng() % 1000000);
+		}
+		good = agrees("MinHeap, full", heap.memory_usage(), baseline) && good;
+		for(int i = 0; i < count; i++){
+			if(i % 10 != 0){
+				heap.erase(handles[i]);
+			}
+		}
+		good = agrees("MinHeap, 90% erased", heap.memory_usage(), baseline) && good;
+		heap.shrink_to_fit();
+		good = agrees("MinHeap, 90% erased, shrunk", heap.memory_usage(), baseline) && good;
+	}
+	return good;
+}
+
+int main()
+{
+	const int count = 200000;
+	bool good = true;
+	good = checkTree<BinarySearchTree<int, int>, false>("BST", count) && good;
+	good = checkTree<AVLTree<int, int>, false>("AVL", count) && good;
+	good = checkTree<AVLTree<int, int>, true>("AVL, half removed", count) && good;
+	good = checkTree<SplayTree<int, int>, false>("Splay", count) && good;
+	good = checkTree<SplayTree<int, int>, true>("Splay, half removed", count) && good;
+	good = checkTree<ScapegoatTree<int, int>, true>("Scapegoat, half removed", count) && good;
+	good = checkHeap(count) && good;
+	return good ? 0 : 1;
+}
+
+#else
+
+int main()
+{
+	std::cout << "mallinfo2 needs glibc 2.33 or later; nothing checked" << std::endl;
+	return 0;
+}
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef MULTIQUEUE_H
+#define MULTIQUEUE_H
+
+#include "Heap.h"
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <functional>
+#include <stdexcept>
+#include <type_traits>
+
+using namespace std;
+
+template <typename T, typename Priority = int, typename Compare = std::less<Priority>, int D = 4>
+class MultiQueue {
+    static_assert(std::is_trivially_copyable<Priority>::value,
+                  "MultiQueue caches shard priorities in std::atomic, so they must be trivially copyable");
+    public:
+        MultiQueue (int threads, int c = 2);
+        /* Constructor that builds a relaxed concurrent priority queue out
+          of c*threads MinHeap shards, each behind its own lock. Throws
+          std::invalid_argument unless threads >= 1 and c >= 1.
+
+          The queue is relaxed: try_pop does not always return the
+          smallest element. Each pop looks at two random shards and takes
+          from the one whose top is better, so with m = c*threads shards
+          the rank of the popped element among everything in the queue is
+          O(m) in expectation and O(m log m) with high probability. c = 2
+          to 4 keeps lock collisions rare. */
+
+        MultiQueue (const MultiQueue & other) = delete;
+        MultiQueue & operator= (const MultiQueue & other) = delete;
+
+        void add (T item, Priority priority);
+         /* adds the item to a random shard. Safe to call from any thread. */
+
+        bool try_pop (T & item);
+         /* moves an element with small priority (see the bound above) into
+            item and returns true, or returns false if every shard was seen
+            empty. Safe to call from any thread. */
+
+        bool isEmpty ();
+         /* returns true iff every shard looked empty when it was checked.
+            Only exact when no other thread is adding. */
+
+    private:
+        // each shard owns a cache line so that the cached tops other threads
+        // read do not share a line with a lock being taken
+        struct alignas(64) shard{
+            std::mutex lock;
+            MinHeap<T, D, Priority, Compare> heap;
+            // copy of heap.peekPriority(), readable without the lock
+            std::atomic<Priority> top;
+            std::atomic<bool> empty;
+            shard() : heap(D ? D : 4), empty(true) {}
+        };
+
+        shard * pick();
+        void publish(shard & s);
+        static std::minstd_rand & rng();
+
+        std::vector<shard> shards;
+        Compare cmp;
+};
+
+template <typename T, typename Priority, typename Compare, int D>
+MultiQueue<T, Priority, Compare, D>::MultiQueue(int threads, int c)
+    : shards(threads >= 1 && c >= 1 ? threads * c : 0){
+    if(threads < 1 || c < 1){
+        throw std::invalid_argument("MultiQueue needs at least one thread and c >= 1");
+    }
+}
+
+template <typename T, typename Priority, typename Compare, int D>
+void MultiQueue<T, Priority, Compare, D>::add(T item, Priority priority){
+    // retry on another shard instead of waiting for a busy one
+    shard * s = &shards[rng()() % shards.size()];
+    while(!s->lock.try_lock()){
+        s = &shards[rng()() % shards.size()];
+    }
+    s->heap.add(std::move(item), priority);
+    publish(*s);
+    s->lock.unlock();
+}
+
+template <typename T, typename Priority, typename Compare, int D>
+bool MultiQueue<T, Priority, Compare, D>::try_pop(T & item){
+    while(true){
+        shard * s = pick();
+        if(s == NULL){
+            // both choices looked empty; only give up once a full sweep agrees
+            if(isEmpty())
+                return false;
+            continue;
+        }
+        if(!s->lock.try_lock())
+            continue;
+        // the cached top may be stale by now, so check under the lock
+        if(s->heap.isEmpty()){
+            s->lock.unlock();
+            continue;
+        }
+        item = s->heap.pop();
+        publish(*s);
+        s->lock.unlock();
+        return true;
+    }
+}
+
+template <typename T, typename Priority, typename Compare, int D>
+bool MultiQueue<T, Priority, Compare, D>::isEmpty(){
+    for(size_t i = 0; i < shards.size(); i++){
+        if(!shards[i].empty.load(std::memory_order_acquire))
+            return false;
+    }
+    return true;
+}
+
+/* the power of two choices: of two random shards, the non-empty one with
+   the better cached top, or NULL when both look empty */
+template <typename T, typename Priority, typename Compare, int D>
+typename MultiQueue<T, Priority, Compare, D>::shard * MultiQueue<T, Priority, Compare, D>::pick(){
+    shard * a = &shards[rng()() % shards.size()];
+    shard * b = &shards[rng()() % shards.size()];
+    bool a_empty = a->empty.load(std::memory_order_acquire);
+    bool b_empty = b->empty.load(std::memory_order_acquire);
+    if(a_empty)
+        return b_empty ? NULL : b;
+    if(b_empty)
+        return a;
+    Priority pa = a->top.load(std::memory_order_relaxed);
+    Priority pb = b->top.load(std::memory_order_relaxed);
+    return cmp(pb, pa) ? b : a;
+}
+
+/* refreshes a shard's cached top; called with its lock held */
+template <typename T, typename Priority, typename Compare, int D>
+void MultiQueue<T, Priority, Compare, D>::publish(shard & s){
+    if(s.heap.isEmpty()){
+        s.empty.store(true, std::memory_order_release);
+    }
+    else{
+        s.top.store(s.heap.peekPriority(), std::memory_order_relaxed);
+        s.empty.store(false, std::memory_order_release);
+    }
+}
+
+/* one generator per thread, so picking shards never contends */
+template <typename T, typename Priority, typename Compare, int D>
+std::minstd_rand & MultiQueue<T, Priority, Compare, D>::rng(){
+    thread_local std::minstd_rand gen(std::hash<std::thread::id>()(std::this_thread::get_id()) | 1);
+    return gen;
+}
+
+#endif
@@ -0,0 +1,394 @@
+#ifndef PARALLELTREE_H
+#define PARALLELTREE_H
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include "../bst/bst.h"
+
+/**
+* A fixed set of threads, each with its own deque of tasks. A worker takes its newest task from
+* the back of its own deque and, when that is empty, steals the oldest task from the front of
+* another's, so work that was split off late and is still large moves to idle threads. The thread
+* that calls wait() works as worker 0 until every submitted task has finished.
+*
+* Tasks get the index of the worker running them, which they pass on when they submit more. Only
+* one thread at a time may submit from outside the pool and wait, so such a caller holds
+* outsideLock() from its first submit until wait() returns; other threads queue up behind it.
+* Tasks must not take it. The first exception a task throws is rethrown by wait().
+*/
+class WorkStealingPool
+{
+public:
+	// 0 threads means one per hardware thread.
+	explicit WorkStealingPool(int threads = 0);
+	~WorkStealingPool();
+
+	WorkStealingPool(const WorkStealingPool& other) = delete;
+	WorkStealingPool& operator=(const WorkStealingPool& other) = delete;
+
+	int threads() const;
+	void submit(int worker, std::function<void(int)> task);
+	void wait();
+	// True while more workers are idle than there are queued tasks for them to take, so
+	// splitting off more work would pay.
+	bool hungry() const;
+	std::mutex& outsideLock();
+
+private:
+	struct Queue
+	{
+		std::mutex mLock;
+		std::deque<std::function<void(int)> > mTasks;
+	};
+
+	void workerLoop(int worker);
+	bool runOne(int worker);
+
+	std::vector<std::unique_ptr<Queue> > mQueues;
+	std::vector<std::thread> mThreads;
+	// tasks submitted and not finished, and tasks still sitting in a deque
+	std::atomic<long long> mPending;
+	std::atomic<long long> mQueued;
+	std::atomic<int> mIdle;
+	std::mutex mOutsideLock;
+	// guards mStop and mError; mWake signals queued work, the last task finishing, or stopping
+	std::mutex mSleepLock;
+	std::condition_variable mWake;
+	bool mStop;
+	std::exception_ptr mError;
+};
+
+/*
+----------------------------------------------------
+Begin implementations for the WorkStealingPool class.
+----------------------------------------------------
+*/
+
+inline WorkStealingPool::WorkStealingPool(int threads)
+	: mPending(0)
+	, mQueued(0)
+	, mIdle(0)
+	, mStop(false)
+{
+	if(threads <= 0){
+		threads = std::thread::hardware_concurrency();
+	}
+	if(threads <= 0){
+		threads = 1;
+	}
+	for(int i = 0; i < threads; i++){
+		mQueues.emplace_back(new Queue());
+	}
+	for(int i = 1; i < threads; i++){
+		mThreads.emplace_back(&WorkStealingPool::workerLoop, this, i);
+	}
+}
+
+inline WorkStealingPool::~WorkStealingPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mSleepLock);
+		mStop = true;
+	}
+	mWake.notify_all();
+	for(size_t i = 0; i < mThreads.size(); i++){
+		mThreads[i].join();
+	}
+}
+
+inline int WorkStealingPool::threads() const
+{
+	return mQueues.size();
+}
+
+inline void WorkStealingPool::submit(int worker, std::function<void(int)> task)
+{
+	mPending++;
+	{
+		std::lock_guard<std::mutex> lock(mQueues[worker]->mLock);
+		mQueues[worker]->mTasks.push_back(std::move(task));
+	}
+	mQueued++;
+	//taking the lock orders this against a worker that has just checked mQueued and is about
+	//to sleep
+	{
+		std::lock_guard<std::mutex> lock(mSleepLock);
+	}
+	mWake.notify_one();
+}
+
+inline void WorkStealingPool::wait()
+{
+	while(mPending > 0){
+		if(runOne(0)){
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(mSleepLock);
+		mIdle++;
+		mWake.wait(lock, [this]{ return mPending == 0 || mQueued > 0; });
+		mIdle--;
+	}
+	std::exception_ptr error;
+	{
+		std::lock_guard<std::mutex> lock(mSleepLock);
+		std::swap(error, mError);
+	}
+	if(error){
+		std::rethrow_exception(error);
+	}
+}
+
+inline bool WorkStealingPool::hungry() const
+{
+	return mIdle.load(std::memory_order_relaxed) > mQueued.load(std::memory_order_relaxed);
+}
+
+inline std::mutex& WorkStealingPool::outsideLock()
+{
+	return mOutsideLock;
+}
+
+inline void WorkStealingPool::workerLoop(int worker)
+{
+	while(true){
+		if(runOne(worker)){
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(mSleepLock);
+		mIdle++;
+		mWake.wait(lock, [this]{ return mStop || mQueued > 0; });
+		mIdle--;
+		if(mStop){
+			return;
+		}
+	}
+}
+
+/**
+* Runs the newest task of the worker's own deque, or else the oldest one it can steal. Returns
+* false if every deque was empty.
+*/
+inline bool WorkStealingPool::runOne(int worker)
+{
+	std::function<void(int)> task;
+	int count = mQueues.size();
+	for(int i = 0; i < count && !task; i++){
+		Queue& queue = *mQueues[(worker + i) % count];
+		std::lock_guard<std::mutex> lock(queue.mLock);
+		if(queue.mTasks.empty()){
+			continue;
+		}
+		if(i == 0){
+			task = std::move(queue.mTasks.back());
+			queue.mTasks.pop_back();
+		}
+		else{
+			task = std::move(queue.mTasks.front());
+			queue.mTasks.pop_front();
+		}
+	}
+	if(!task){
+		return false;
+	}
+	mQueued--;
+	try{
+		task(worker);
+	}
+	catch(...){
+		std::lock_guard<std::mutex> lock(mSleepLock);
+		if(!mError){
+			mError = std::current_exception();
+		}
+	}
+	if(--mPending == 0){
+		std::lock_guard<std::mutex> lock(mSleepLock);
+		mWake.notify_all();
+	}
+	return true;
+}
+
+/*
+--------------------------------------------------
+End implementations for the WorkStealingPool class.
+--------------------------------------------------
+*/
+
+/**
+* The pool the parallel traversals use when none is given, with one thread per hardware thread.
+* It is shared by every thread of the process; the traversals take its outsideLock(), so
+* traversals started from different threads run one after another.
+*/
+inline WorkStealingPool& defaultTreePool()
+{
+	static WorkStealingPool pool;
+	return pool;
+}
+
+/**
+* Helper that visits every node below top, splitting off the right subtree as a new task
+* whenever a worker is idle and there is other work left here to carry on with. A chain of
+* single children cannot be split and is walked by one thread.
+*/
+template<typename Key, typename Value, typename Visit>
+void parallelVisitBelow(Node<Key, Value>* top, Visit& visit, WorkStealingPool& pool, int worker)
+{
+	std::vector<Node<Key, Value>*> stack;
+	stack.push_back(top);
+	while(!stack.empty()){
+		Node<Key, Value>* aNode = stack.back();
+		stack.pop_back();
+		visit(aNode->getItem(), worker);
+		Node<Key, Value>* right = aNode->getRight();
+		if(right != NULL){
+			if(pool.hungry() && (aNode->getLeft() != NULL || !stack.empty())){
+				pool.submit(worker, [right, &visit, &pool](int thief){
+					parallelVisitBelow(right, visit, pool, thief);
+				});
+			}
+			else{
+				stack.push_back(right);
+			}
+		}
+		if(aNode->getLeft() != NULL){
+			stack.push_back(aNode->getLeft());
+		}
+	}
+}
+
+/**
+* Calls fn(const Key&, Value&) once for every item of a BST, AVL, splay or scapegoat tree, on the
+* pool's threads and in no particular order. fn may change values, but not keys, and must be
+* safe to call from several threads at once. Nothing may write to the tree, or splay it with
+* find, until this returns, and fn must not start another traversal on the same pool.
+*
+* None of the trees keep subtree sizes, so the work is split by shape: the walk starts as one
+* task and hands right subtrees to idle workers as it goes, which adapts to unbalanced trees
+* without a sizing pass.
+*/
+template<typename Key, typename Value, typename Fn>
+void parallel_for_each(BinarySearchTree<Key, Value>& tree, Fn fn, WorkStealingPool& pool = defaultTreePool())
+{
+	Node<Key, Value>* root = tree.getRoot();
+	if(root == NULL){
+		return;
+	}
+	auto visit = [&fn](std::pair<Key, Value>& item, int){ fn(static_cast<const Key&>(item.first), item.second); };
+	std::lock_guard<std::mutex> outside(pool.outsideLock());
+	pool.submit(0, [root, &visit, &pool](int worker){
+		parallelVisitBelow(root, visit, pool, worker);
+	});
+	pool.wait();
+}
+
+/**
+* Helper for the ordered reduce that cuts the tree at the given depth into an in-order list of
+* pieces: whole subtrees at that depth, and the single nodes above them.
+*/
+template<typename Key, typename Value>
+void parallelPieces(Node<Key, Value>* aNode, int depth, std::vector<std::pair<Node<Key, Value>*, bool> >& pieces)
+{
+	if(aNode == NULL){
+		return;
+	}
+	if(depth == 0){
+		pieces.push_back(std::make_pair(aNode, true));
+		return;
+	}
+	parallelPieces(aNode->getLeft(), depth - 1, pieces);
+	pieces.push_back(std::make_pair(aNode, false));
+	parallelPieces(aNode->getRight(), depth - 1, pieces);
+}
+
+/**
+* Folds every item of the tree into one result. Each piece of the tree starts from init and
+* folds its items with accumulate(R, const std::pair<Key, Value>&), and the pieces' results are
+* merged with combine(R, R), so init must be an identity of combine. The result for an empty tree
+* is init.
+*
+* With ordered set, pieces are merged in key order, which only needs combine to be associative
+* (concatenation, first/last, running state). The tree is cut at a fixed depth into 8 to 16
+* pieces per thread for that, so a badly unbalanced tree splits unevenly. Without it, each worker
+* keeps one running result for everything it visits and the work splits adaptively as in
+* parallel_for_each, but accumulate then sees items in any order and combine must also be
+* commutative (sums, counts, min/max). Nothing may write to the tree until this returns, and
+* neither function may start another traversal on the same pool.
+*/
+template<typename Key, typename Value, typename R, typename Accumulate, typename Combine>
+R parallel_reduce(BinarySearchTree<Key, Value>& tree, R init, Accumulate accumulate, Combine combine,
+	bool ordered = true, WorkStealingPool& pool = defaultTreePool())
+{
+	//each partial result gets its own cache line
+	struct alignas(64) Partial
+	{
+		R mValue;
+	};
+
+	Node<Key, Value>* root = tree.getRoot();
+	if(root == NULL){
+		return init;
+	}
+	std::lock_guard<std::mutex> outside(pool.outsideLock());
+
+	if(!ordered){
+		std::vector<Partial> partials(pool.threads(), Partial{init});
+		auto visit = [&partials, &accumulate](std::pair<Key, Value>& item, int worker){
+			partials[worker].mValue = accumulate(partials[worker].mValue, item);
+		};
+		pool.submit(0, [root, &visit, &pool](int worker){
+			parallelVisitBelow(root, visit, pool, worker);
+		});
+		pool.wait();
+		R result = partials[0].mValue;
+		for(size_t i = 1; i < partials.size(); i++){
+			result = combine(result, partials[i].mValue);
+		}
+		return result;
+	}
+
+	int depth = 0;
+	while((1 << depth) < pool.threads() * 8){
+		depth++;
+	}
+	std::vector<std::pair<Node<Key, Value>*, bool> > pieces;
+	parallelPieces(root, depth, pieces);
+	std::vector<Partial> partials(pieces.size(), Partial{init});
+	for(size_t i = 0; i < pieces.size(); i++){
+		if(!pieces[i].second){
+			partials[i].mValue = accumulate(partials[i].mValue, pieces[i].first->getItem());
+			continue;
+		}
+		Node<Key, Value>* top = pieces[i].first;
+		R* slot = &partials[i].mValue;
+		pool.submit(i % pool.threads(), [top, slot, &accumulate](int){
+			//in-order walk of the piece with an explicit stack
+			std::vector<Node<Key, Value>*> stack;
+			Node<Key, Value>* aNode = top;
+			while(aNode != NULL || !stack.empty()){
+				while(aNode != NULL){
+					stack.push_back(aNode);
+					aNode = aNode->getLeft();
+				}
+				aNode = stack.back();
+				stack.pop_back();
+				*slot = accumulate(*slot, aNode->getItem());
+				aNode = aNode->getRight();
+			}
+		});
+	}
+	pool.wait();
+	R result = partials[0].mValue;
+	for(size_t i = 1; i < partials.size(); i++){
+		result = combine(result, partials[i].mValue);
+	}
+	return result;
+}
+
+#endif
@@ -0,0 +1,280 @@
+#ifndef RADIXHEAP_H
+#define RADIXHEAP_H
+
+#include <iostream>
+#include <vector>
+#include <limits>
+#include <stdexcept>
+#include <exception>
+#include <utility>
+#include <type_traits>
+#include <optional>
+#include <algorithm>
+#include <cstdint>
+
+using namespace std;
+
+template <typename T, typename Priority = unsigned int>
+class RadixHeap {
+    static_assert(std::is_integral<Priority>::value && std::is_unsigned<Priority>::value,
+                  "RadixHeap needs unsigned integer priorities");
+    public:
+        typedef int64_t handle;
+        /* a slot number and that slot's generation, as for MinHeap::handle,
+           so a handle kept after its item left the heap is rejected. */
+
+        RadixHeap ();
+        /* Constructor that builds an empty radix heap. A radix heap only
+          works for monotone use: every priority given to add or update
+          must be at least the priority of the element most recently
+          returned by peek or removed, as in Dijkstra or an event
+          simulation. In exchange every operation is O(1) except finding
+          the next minimum, which is O(log C) amortized for priorities
+          below C. */
+
+        handle add (T item, Priority priority);
+         /* adds the item to the heap, with the given priority. Returns a
+            handle for the item, like MinHeap::add. Throws
+            std::invalid_argument if the priority is below the last minimum.
+            T does not need a default constructor. */
+
+        const T & peek () const;
+         /* returns an element with smallest priority. Unlike MinHeap, ties
+            are not broken by the data; any of the tied elements may come
+            first. */
+
+        void remove ();
+         /* removes the element that peek returns. */
+
+        void update (handle h, Priority priority);
+         /* finds the item with the given handle and gives it the new
+            priority in O(1). Lowering it is the usual decrease-key, but
+            the new priority must still not be below the last minimum.
+            Throws std::out_of_range if the handle is not in the heap and
+            std::invalid_argument if the priority is too small. */
+
+        void erase (handle h);
+         /* removes the item with the given handle from the heap and
+            destroys it. Throws std::out_of_range if the handle is not in
+            the heap. */
+
+        bool isEmpty ();
+         /* returns true iff there are no elements on the heap. */
+
+        void shrink_to_fit ();
+         /* gives back memory the heap no longer needs: trailing slots that
+            hold no item and spare capacity in the slot table and buckets.
+            Slots of items still in the heap keep their numbers. */
+
+   private:
+        // bucket 0 holds the items whose priority equals last. Bucket i > 0
+        // holds the items whose priority first differs from last in bit i-1,
+        // counting from the lowest bit. Finding a new minimum empties the
+        // first non-empty bucket into strictly lower ones, so each item
+        // moves at most once per bit.
+        static const int BUCKETS = std::numeric_limits<Priority>::digits + 1;
+
+        // value is empty while the slot is free, so a removed item is
+        // destroyed right away rather than when its slot is reused
+        struct data{
+            Priority priority;
+            int bucket;
+            int index;
+            uint32_t gen;
+            std::optional<T> value;
+        };
+
+        int bucketOf(Priority priority) const;
+        void place(int id) const;
+        void take(int id) const;
+        void settle() const;
+        void checkPriority(Priority priority) const;
+        int checkHandle(handle h) const;
+
+        // peek has to move items between buckets to find the minimum, so
+        // the bucket bookkeeping is mutable
+        mutable std::vector<int> buckets[BUCKETS];
+        mutable std::vector<data> nodes;
+        mutable Priority last;
+        // slots that can be given out again
+        std::vector<int> free_ids;
+        // generation new slots start at, above that of any slot
+        // shrink_to_fit dropped
+        uint32_t fresh_gen;
+        int size;
+};
+
+template <typename T, typename Priority>
+RadixHeap<T, Priority>::RadixHeap(){
+    last = 0;
+    size = 0;
+    fresh_gen = 0;
+}
+
+template <typename T, typename Priority>
+typename RadixHeap<T, Priority>::handle RadixHeap<T, Priority>::add(T item, Priority priority){
+    checkPriority(priority);
+    int id;
+    if(free_ids.empty()){
+        id = nodes.size();
+        nodes.emplace_back();
+        nodes[id].gen = fresh_gen;
+    }
+    else{
+        id = free_ids.back();
+        free_ids.pop_back();
+    }
+    nodes[id].value.emplace(std::move(item));
+    nodes[id].priority = priority;
+    place(id);
+    size++;
+    return ((handle)nodes[id].gen << 32) | id;
+}
+
+template <typename T, typename Priority>
+const T & RadixHeap<T, Priority>::peek() const{
+    if(size == 0){
+        throw std::out_of_range("Index is out of range");
+    }
+    settle();
+    return *nodes[buckets[0].back()].value;
+}
+
+template <typename T, typename Priority>
+void RadixHeap<T, Priority>::remove(){
+    if(size == 0){
+        throw std::out_of_range("Index is out of range");
+    }
+    settle();
+    int id = buckets[0].back();
+    erase(((handle)nodes[id].gen << 32) | id);
+}
+
+template <typename T, typename Priority>
+void RadixHeap<T, Priority>::update(handle h, Priority priority){
+    int n = checkHandle(h);
+    checkPriority(priority);
+    take(n);
+    nodes[n].priority = priority;
+    place(n);
+}
+
+template <typename T, typename Priority>
+void RadixHeap<T, Priority>::erase(handle h){
+    int n = checkHandle(h);
+    take(n);
+    nodes[n].bucket = -1;
+    // a new generation retires every handle to the slot
+    nodes[n].gen = (nodes[n].gen + 1) & 0x7fffffff;
+    nodes[n].value.reset();
+    free_ids.push_back(n);
+    size--;
+}
+
+template <typename T, typename Priority>
+bool RadixHeap<T, Priority>::isEmpty(){
+    if(size>0)
+        return false;
+    else
+        return true;
+}
+
+template <typename T, typename Priority>
+void RadixHeap<T, Priority>::shrink_to_fit(){
+    int keep = nodes.size();
+    while(keep > 0 && nodes[keep-1].bucket < 0){
+        keep--;
+        // the slot may be created again, with none of its old generations
+        fresh_gen = std::max(fresh_gen, nodes[keep].gen);
+    }
+    nodes.resize(keep);
+    int kept = 0;
+    for(size_t i = 0; i < free_ids.size(); i++){
+        if(free_ids[i] < keep)
+            free_ids[kept++] = free_ids[i];
+    }
+    free_ids.resize(kept);
+
+    nodes.shrink_to_fit();
+    free_ids.shrink_to_fit();
+    for(int b = 0; b < BUCKETS; b++){
+        buckets[b].shrink_to_fit();
+    }
+}
+
+/* 0 for the current minimum, otherwise one more than the highest bit in
+   which the priority differs from it */
+template <typename T, typename Priority>
+int RadixHeap<T, Priority>::bucketOf(Priority priority) const{
+    if(priority == last)
+        return 0;
+    return 64 - __builtin_clzll((unsigned long long)(priority ^ last));
+}
+
+/* puts an item into the bucket its priority belongs to */
+template <typename T, typename Priority>
+void RadixHeap<T, Priority>::place(int id) const{
+    int b = bucketOf(nodes[id].priority);
+    nodes[id].bucket = b;
+    nodes[id].index = buckets[b].size();
+    buckets[b].push_back(id);
+}
+
+/* takes an item out of its bucket by moving the bucket's last item into
+   its slot */
+template <typename T, typename Priority>
+void RadixHeap<T, Priority>::take(int id) const{
+    std::vector<int> & bucket = buckets[nodes[id].bucket];
+    int moved = bucket.back();
+    bucket[nodes[id].index] = moved;
+    nodes[moved].index = nodes[id].index;
+    bucket.pop_back();
+}
+
+/* makes sure bucket 0 holds the minimum: when it is empty, the smallest
+   priority in the first non-empty bucket becomes the new last and that
+   bucket is spread over the lower ones */
+template <typename T, typename Priority>
+void RadixHeap<T, Priority>::settle() const{
+    if(!buckets[0].empty())
+        return;
+    int b = 1;
+    while(buckets[b].empty())
+        b++;
+
+    Priority lowest = nodes[buckets[b][0]].priority;
+    for(size_t i = 1; i < buckets[b].size(); i++){
+        if(nodes[buckets[b][i]].priority < lowest)
+            lowest = nodes[buckets[b][i]].priority;
+    }
+    last = lowest;
+
+    std::vector<int> spread;
+    spread.swap(buckets[b]);
+    for(size_t i = 0; i < spread.size(); i++){
+        place(spread[i]);
+    }
+    // hand the emptied storage back so the bucket does not reallocate later
+    spread.clear();
+    buckets[b].swap(spread);
+}
+
+template <typename T, typename Priority>
+void RadixHeap<T, Priority>::checkPriority(Priority priority) const{
+    if(priority < last){
+        throw std::invalid_argument("Priority is below the last minimum");
+    }
+}
+
+/* returns the slot of a handle whose item is still in the heap, and throws
+   std::out_of_range for any other handle */
+template <typename T, typename Priority>
+int RadixHeap<T, Priority>::checkHandle(handle h) const{
+    long long id = h & 0xffffffff;
+    if(h < 0 || id >= (long long)nodes.size() || nodes[id].bucket < 0 || (h >> 32) != nodes[id].gen){
+        throw std::out_of_range("Handle is not in the heap");
+    }
+    return (int)id;
+}
+
+#endif
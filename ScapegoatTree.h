@@ -0,0 +1,362 @@
+#ifndef SCAPEGOAT_H
+#define SCAPEGOAT_H
+
+#include <iostream>
+#include <cstdlib>
+#include <string>
+#include <cmath>
+#include <vector>
+#include <stdexcept>
+#include "../bst/bst.h"
+
+/**
+* A templated balanced binary search tree implemented as a scapegoat tree. It uses the plain
+* Node and keeps no balance information in it at all; the tree only remembers its size and the
+* largest size it has had since it was last rebuilt.
+*
+* An insert that lands deeper than log_{1/alpha}(n) walks back up to the first ancestor whose
+* subtree is out of alpha-weight balance (one child holds more than alpha of it) and rebuilds
+* that subtree into a perfectly balanced one in linear time. A remove that leaves fewer than
+* alpha times the largest size rebuilds the whole tree. Both take O(log n) amortized time and
+* the depth never exceeds log_{1/alpha}(n) + 1. Smaller alpha keeps the tree shallower at the
+* price of more rebuilding.
+*/
+template <class Key, class Value>
+class ScapegoatTree : public BinarySearchTree<Key, Value>
+{
+public:
+	ScapegoatTree(double alpha = 0.7);
+
+	virtual void insert(const std::pair<Key, Value>& keyValuePair) override;
+	virtual void insert(typename BinarySearchTree<Key, Value>::iterator hint, const std::pair<Key, Value>& keyValuePair) override;
+	void remove(const Key& key);
+	virtual void clear() override;
+
+	int size() const;
+	// Like the base versions, plus the scratch space rebuilds keep between calls.
+	MemoryUsage memory_usage() const;
+	void shrink_to_fit();
+
+private:
+	void insertBelow(Node<Key, Value>* start, int depth, const std::pair<Key, Value>& keyValuePair);
+	int depthLimit() const;
+	int subtreeSize(Node<Key, Value>* aNode);
+	void rebuild(Node<Key, Value>* top);
+	Node<Key, Value>* buildBalanced(int lo, int hi, Node<Key, Value>* parent);
+
+	double mAlpha;
+	// 1 / log(1 / alpha), so log_{1/alpha}(n) is log(n) times this
+	double mDepthFactor;
+	int mSize;
+	int mMaxSize;
+	// scratch space for the nodes of a subtree being rebuilt, kept to avoid reallocating it
+	std::vector<Node<Key, Value>*> mNodes;
+};
+
+/*
+--------------------------------------------------
+Begin implementations for the ScapegoatTree class.
+--------------------------------------------------
+*/
+
+/**
+* Constructor for an empty tree. Throws std::invalid_argument unless 0.5 < alpha < 1.
+*/
+template<typename Key, typename Value>
+ScapegoatTree<Key, Value>::ScapegoatTree(double alpha)
+	: mAlpha(alpha)
+	, mSize(0)
+	, mMaxSize(0)
+{
+	if(!(alpha > 0.5 && alpha < 1)){
+		throw std::invalid_argument("Alpha must be between 0.5 and 1");
+	}
+	mDepthFactor = 1 / std::log(1 / alpha);
+}
+
+/**
+* Insert function for a key value pair. Overwrites the value if the key is already there.
+*/
+template<typename Key, typename Value>
+void ScapegoatTree<Key, Value>::insert(const std::pair<Key, Value>& keyValuePair)
+{
+	TREES_LATENCY_SCOPE(this->mLatency.insert);
+	insertBelow(this->mRoot, 0, keyValuePair);
+}
+
+/**
+* Insert function that starts looking for the insert position at hint instead of at the root.
+* The depth of the new node still has to be known, so this climbs from the start of the search
+* to the root, which is no worse than the O(log n) the insert costs anyway.
+*/
+template<typename Key, typename Value>
+void ScapegoatTree<Key, Value>::insert(typename BinarySearchTree<Key, Value>::iterator hint, const std::pair<Key, Value>& keyValuePair)
+{
+	if(this->mRoot == NULL || this->nodeOf(hint) == NULL){
+		ScapegoatTree<Key, Value>::insert(keyValuePair);
+		return;
+	}
+	TREES_LATENCY_SCOPE(this->mLatency.insert);
+	Node<Key, Value>* start = this->fingerStart(keyValuePair.first, this->nodeOf(hint));
+	int depth = 0;
+	for(Node<Key, Value>* temp = start; temp->getParent() != NULL; temp = temp->getParent()){
+		depth++;
+	}
+	insertBelow(start, depth, keyValuePair);
+}
+
+/**
+* Remove function for a given key. A node with two children trades items with its in-order
+* successor, which is then unlinked instead.
+*/
+template<typename Key, typename Value>
+void ScapegoatTree<Key, Value>::remove(const Key& key)
+{
+	TREES_LATENCY_SCOPE(this->mLatency.remove);
+	Node<Key, Value>* aNode = this->internalFind(key);
+	if(aNode == NULL){
+		return;
+	}
+	this->mEpoch++;
+
+	if(aNode->getLeft() != NULL && aNode->getRight() != NULL){
+		Node<Key, Value>* aSuccessor = aNode->getRight();
+		while(aSuccessor->getLeft() != NULL){
+			aSuccessor = aSuccessor->getLeft();
+		}
+		std::swap(aNode->getItem(), aSuccessor->getItem());
+		aNode = aSuccessor;
+	}
+
+	Node<Key, Value>* aChild = aNode->getLeft() != NULL ? aNode->getLeft() : aNode->getRight();
+	Node<Key, Value>* aParent = aNode->getParent();
+	if(aChild != NULL){
+		aChild->setParent(aParent);
+	}
+	if(aParent == NULL){
+		this->mRoot = aChild;
+	}
+	else if(aParent->getLeft() == aNode){
+		aParent->setLeft(aChild);
+	}
+	else{
+		aParent->setRight(aChild);
+	}
+	this->destroyNode(aNode);
+	mSize--;
+
+	if(mSize < mAlpha * mMaxSize){
+		if(this->mRoot != NULL){
+			rebuild(this->mRoot);
+		}
+		mMaxSize = mSize;
+	}
+}
+
+template<typename Key, typename Value>
+void ScapegoatTree<Key, Value>::clear()
+{
+	BinarySearchTree<Key, Value>::clear();
+	mSize = 0;
+	mMaxSize = 0;
+}
+
+template<typename Key, typename Value>
+int ScapegoatTree<Key, Value>::size() const
+{
+	return mSize;
+}
+
+/**
+* The rebuild scratch space is empty between calls, so all of it counts as slack.
+*/
+template<typename Key, typename Value>
+MemoryUsage ScapegoatTree<Key, Value>::memory_usage() const
+{
+	MemoryUsage usage = BinarySearchTree<Key, Value>::memory_usage();
+	addVectorUsage(usage, mNodes);
+	return usage;
+}
+
+/**
+* Compacts the nodes and gives back the rebuild scratch space; the next rebuild allocates it again.
+*/
+template<typename Key, typename Value>
+void ScapegoatTree<Key, Value>::shrink_to_fit()
+{
+	BinarySearchTree<Key, Value>::shrink_to_fit();
+	std::vector<Node<Key, Value>*>().swap(mNodes);
+}
+
+/**
+* Helper that inserts the pair somewhere below start, which sits at the given depth, and
+* rebuilds around the new node if it ended up too deep.
+*/
+template<typename Key, typename Value>
+void ScapegoatTree<Key, Value>::insertBelow(Node<Key, Value>* start, int depth, const std::pair<Key, Value>& keyValuePair)
+{
+	this->mEpoch++;
+	if(start == NULL){
+		this->mRoot = new Node<Key, Value>(keyValuePair.first, keyValuePair.second, NULL);
+		mSize = 1;
+		mMaxSize = 1;
+		return;
+	}
+
+	Node<Key, Value>* temp = start;
+	Node<Key, Value>* aNode;
+	while(true){
+		if(temp->getKey() == keyValuePair.first){
+			temp->setValue(keyValuePair.second);
+			return;
+		}
+		depth++;
+		if(keyValuePair.first < temp->getKey()){
+			if(temp->getLeft() == NULL){
+				aNode = new Node<Key, Value>(keyValuePair.first, keyValuePair.second, temp);
+				temp->setLeft(aNode);
+				break;
+			}
+			temp = temp->getLeft();
+		}
+		else{
+			if(temp->getRight() == NULL){
+				aNode = new Node<Key, Value>(keyValuePair.first, keyValuePair.second, temp);
+				temp->setRight(aNode);
+				break;
+			}
+			temp = temp->getRight();
+		}
+	}
+	mSize++;
+	if(mSize > mMaxSize){
+		mMaxSize = mSize;
+	}
+	if(depth <= depthLimit()){
+		return;
+	}
+
+	//climb until a node's subtree is out of balance; the sizes of the child we came from are
+	//already known, so only the sibling subtrees are counted, O(size of the scapegoat) in all
+	int childSize = 1;
+	Node<Key, Value>* child = aNode;
+	Node<Key, Value>* parent = aNode->getParent();
+	while(parent != NULL){
+		Node<Key, Value>* sibling = parent->getLeft() == child ? parent->getRight() : parent->getLeft();
+		int parentSize = 1 + childSize + subtreeSize(sibling);
+		if(childSize > mAlpha * parentSize){
+			rebuild(parent);
+			return;
+		}
+		childSize = parentSize;
+		child = parent;
+		parent = parent->getParent();
+	}
+}
+
+/**
+* The deepest an inserted node may be before a rebuild, floor(log_{1/alpha}(n)).
+*/
+template<typename Key, typename Value>
+int ScapegoatTree<Key, Value>::depthLimit() const
+{
+	return (int)(std::log((double)mSize) * mDepthFactor);
+}
+
+/**
+* Helper that counts the nodes of a subtree without recursing.
+*/
+template<typename Key, typename Value>
+int ScapegoatTree<Key, Value>::subtreeSize(Node<Key, Value>* aNode)
+{
+	if(aNode == NULL){
+		return 0;
+	}
+	mNodes.clear();
+	mNodes.push_back(aNode);
+	int count = 0;
+	while(!mNodes.empty()){
+		Node<Key, Value>* temp = mNodes.back();
+		mNodes.pop_back();
+		count++;
+		if(temp->getLeft() != NULL){
+			mNodes.push_back(temp->getLeft());
+		}
+		if(temp->getRight() != NULL){
+			mNodes.push_back(temp->getRight());
+		}
+	}
+	return count;
+}
+
+/**
+* Rebuilds the subtree rooted at top into a perfectly balanced one made of the same nodes, in
+* linear time: lists them in order, then relinks them around the middle of each range.
+*/
+template<typename Key, typename Value>
+void ScapegoatTree<Key, Value>::rebuild(Node<Key, Value>* top)
+{
+	Node<Key, Value>* parent = top->getParent();
+	bool wasLeft = parent != NULL && parent->getLeft() == top;
+
+	mNodes.clear();
+	Node<Key, Value>* temp = top;
+	//in-order walk that stops once it climbs back out of the subtree
+	while(temp->getLeft() != NULL){
+		temp = temp->getLeft();
+	}
+	while(temp != parent){
+		mNodes.push_back(temp);
+		if(temp->getRight() != NULL){
+			temp = temp->getRight();
+			while(temp->getLeft() != NULL){
+				temp = temp->getLeft();
+			}
+		}
+		else{
+			Node<Key, Value>* from = temp;
+			temp = temp->getParent();
+			while(temp != parent && temp->getRight() == from){
+				from = temp;
+				temp = temp->getParent();
+			}
+		}
+	}
+
+	Node<Key, Value>* built = buildBalanced(0, mNodes.size(), parent);
+	if(parent == NULL){
+		this->mRoot = built;
+	}
+	else if(wasLeft){
+		parent->setLeft(built);
+	}
+	else{
+		parent->setRight(built);
+	}
+}
+
+/**
+* Helper that links mNodes[lo, hi) into a balanced subtree under parent and returns its root.
+* The recursion is only as deep as the rebuilt subtree's height.
+*/
+template<typename Key, typename Value>
+Node<Key, Value>* ScapegoatTree<Key, Value>::buildBalanced(int lo, int hi, Node<Key, Value>* parent)
+{
+	if(lo >= hi){
+		return NULL;
+	}
+	int middle = lo + (hi - lo) / 2;
+	Node<Key, Value>* aNode = mNodes[middle];
+	aNode->setParent(parent);
+	aNode->setLeft(buildBalanced(lo, middle, aNode));
+	aNode->setRight(buildBalanced(middle + 1, hi, aNode));
+	return aNode;
+}
+
+/*
+------------------------------------------------
+End implementations for the ScapegoatTree class.
+------------------------------------------------
+*/
+
+#endif
@@ -0,0 +1,726 @@
+#ifndef SHARDEDTREE_H
+#define SHARDEDTREE_H
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+#include "AvlTree.h"
+
+/**
+* An ordered map for many concurrent writers. The key space is split by range into AVLTree
+* shards, each behind its own lock, so writers to different ranges do not wait for each other.
+* Shard i holds the keys from bound i-1 up to but not including bound i.
+*
+* Shards rebalance by themselves. The tree starts with one shard and splits a shard in half
+* whenever it holds more than MIN_SHARD keys, until it has the requested number of shards.
+* After that a shard that grows past twice the average hands half the difference in size to its
+* lighter neighbour and the bound between them moves. Either step moves O(shard size) keys and
+* is paid for by the inserts that made the shard heavy.
+*
+* The bounds are kept in an immutable layout that a rebalancing step replaces as a whole, so
+* find, insert and remove read them without a lock and then lock one shard. They write no memory
+* that operations on other shards touch, apart from a count of layout readers that is spread over
+* 64 cache lines. A step locks only the shards it moves keys between; operations that picked one
+* of them from the old layout notice under the shard's lock that the key has moved and look again.
+*
+* for_each and scan visit the shards in key order and lock each one while they visit it, so each
+* shard is seen consistently but writes to a shard that has not been visited yet will be seen.
+* They hold off rebalancing while they run. begin()/end() walk the shards without any locking
+* and must not run alongside writers.
+*/
+template <typename Key, typename Value>
+class ShardedTree
+{
+public:
+	ShardedTree(int shards = 16);
+	ShardedTree(const std::vector<Key>& boundaries);
+	~ShardedTree();
+
+	ShardedTree(const ShardedTree& other) = delete;
+	ShardedTree& operator=(const ShardedTree& other) = delete;
+
+	void insert(const std::pair<Key, Value>& keyValuePair);
+	void remove(const Key& key);
+	// Copies the value for key into value and returns true, or returns false if key is absent.
+	bool find(const Key& key, Value& value) const;
+	long long size() const;
+	int shards() const;
+
+	// Calls visit(pair) for every item, or every item with lo <= key < hi, in key order. visit
+	// runs under a shard lock, so it must not call back into the tree.
+	template <typename Visit>
+	void for_each(Visit visit) const;
+	template <typename Visit>
+	void scan(const Key& lo, const Key& hi, Visit visit) const;
+
+public:
+	/**
+	* Walks all shards in key order. Not safe alongside writers.
+	*/
+	class iterator
+	{
+	public:
+		iterator();
+
+		std::pair<Key, Value>& operator*();
+		std::pair<Key, Value>* operator->();
+
+		bool operator==(const iterator& rhs) const;
+		bool operator!=(const iterator& rhs) const;
+
+		iterator& operator++();
+
+	protected:
+		iterator(ShardedTree<Key, Value>* owner, int shard);
+		void skipEmpty();
+
+		ShardedTree<Key, Value>* mOwner;
+		int mShard;
+		typename BinarySearchTree<Key, Value>::iterator mCurrent;
+		friend class ShardedTree<Key, Value>;
+	};
+
+	iterator begin();
+	iterator end();
+
+protected:
+	static const long long MIN_SHARD = 1024;
+	static const int READER_STRIPES = 64;
+
+	struct Shard
+	{
+		Shard() : mSize(0), mHasLow(false), mHasHigh(false) {}
+
+		mutable std::shared_mutex mLock;
+		AVLTree<Key, Value> mTree;
+		std::atomic<long long> mSize;
+		// the range the shard holds now, from mLow up to but not including mHigh, where those
+		// are set; guarded by mLock, and checked by operations that found the shard through a
+		// layout that may be out of date
+		bool mHasLow;
+		bool mHasHigh;
+		Key mLow;
+		Key mHigh;
+	};
+
+	// The shards in key order and the bounds between them; mBounds[i] is the smallest key shard
+	// i+1 may hold. Never changed once published.
+	struct Layout
+	{
+		std::vector<Shard*> mShards;
+		std::vector<Key> mBounds;
+	};
+
+	// The number of threads reading the published layout, one counter per cache line.
+	struct alignas(64) ReaderStripe
+	{
+		ReaderStripe() : mReaders(0) {}
+
+		std::atomic<long long> mReaders;
+	};
+
+	// Keeps the layout it loaded from being freed until it goes out of scope.
+	class LayoutReader
+	{
+	public:
+		LayoutReader(const ShardedTree<Key, Value>& owner);
+		~LayoutReader();
+
+		const Layout& layout() const;
+
+	private:
+		ReaderStripe& mStripe;
+		const Layout* mLayout;
+	};
+
+	static int readerStripe();
+	static bool owns(const Shard& shard, const Key& key);
+	static int shardOf(const Layout& layout, const Key& key);
+	Shard* route(const Key& key) const;
+	bool isHeavy(long long shardSize) const;
+	void rebalance();
+	Layout* split(const Layout& layout, int shard);
+	Layout* spill(const Layout& layout, int shard);
+	void retire(Layout* old);
+	std::vector<std::pair<Key, Value> > take(Shard& shard, long long skip, long long count);
+	void give(Shard& shard, const std::vector<std::pair<Key, Value> >& items);
+
+	// every shard ever made; shards live as long as the tree, so one found through an old layout
+	// can still be locked. Only rebalancing adds to it.
+	std::vector<std::unique_ptr<Shard> > mAllShards;
+	std::atomic<Layout*> mLayout;
+	mutable ReaderStripe mReaders[READER_STRIPES];
+	int mMaxShards;
+	std::atomic<int> mShardCount;
+	// held shared by for_each and scan and exclusively while shards split or spill
+	mutable std::shared_mutex mRebalanceLock;
+	std::atomic<bool> mRebalancing;
+};
+
+/*
+----------------------------------------------------------
+Begin implementations for the ShardedTree::iterator class.
+----------------------------------------------------------
+*/
+
+template<typename Key, typename Value>
+ShardedTree<Key, Value>::iterator::iterator()
+	: mOwner(NULL)
+	, mShard(0)
+{
+
+}
+
+/**
+* An iterator at the first item of the given shard or, if that is empty, of the next shard
+* that is not.
+*/
+template<typename Key, typename Value>
+ShardedTree<Key, Value>::iterator::iterator(ShardedTree<Key, Value>* owner, int shard)
+	: mOwner(owner)
+	, mShard(shard)
+{
+	const Layout& layout = *mOwner->mLayout.load();
+	if(mShard < (int)layout.mShards.size()){
+		mCurrent = layout.mShards[mShard]->mTree.begin();
+	}
+	skipEmpty();
+}
+
+template<typename Key, typename Value>
+std::pair<Key, Value>& ShardedTree<Key, Value>::iterator::operator*()
+{
+	return *mCurrent;
+}
+
+template<typename Key, typename Value>
+std::pair<Key, Value>* ShardedTree<Key, Value>::iterator::operator->()
+{
+	return &*mCurrent;
+}
+
+template<typename Key, typename Value>
+bool ShardedTree<Key, Value>::iterator::operator==(const iterator& rhs) const
+{
+	return mShard == rhs.mShard && mCurrent == rhs.mCurrent;
+}
+
+template<typename Key, typename Value>
+bool ShardedTree<Key, Value>::iterator::operator!=(const iterator& rhs) const
+{
+	return !(*this == rhs);
+}
+
+template<typename Key, typename Value>
+typename ShardedTree<Key, Value>::iterator& ShardedTree<Key, Value>::iterator::operator++()
+{
+	++mCurrent;
+	skipEmpty();
+	return *this;
+}
+
+/**
+* Moves past the end of used-up shards to the start of the next one with items, or to the end.
+*/
+template<typename Key, typename Value>
+void ShardedTree<Key, Value>::iterator::skipEmpty()
+{
+	if(mOwner == NULL){
+		return;
+	}
+	const Layout& layout = *mOwner->mLayout.load();
+	int count = layout.mShards.size();
+	while(mShard < count && mCurrent == layout.mShards[mShard]->mTree.end()){
+		mShard++;
+		if(mShard < count){
+			mCurrent = layout.mShards[mShard]->mTree.begin();
+		}
+	}
+	if(mShard >= count){
+		mShard = count;
+		mCurrent = typename BinarySearchTree<Key, Value>::iterator();
+	}
+}
+
+/*
+--------------------------------------------------------
+End implementations for the ShardedTree::iterator class.
+--------------------------------------------------------
+*/
+
+/*
+--------------------------------------------------------------
+Begin implementations for the ShardedTree::LayoutReader class.
+--------------------------------------------------------------
+*/
+
+/**
+* Counts this thread as a reader before loading the layout. Rebalancing swaps the layout before
+* it waits for the counts to drain, so a reader it does not wait for loads the new layout.
+*/
+template<typename Key, typename Value>
+ShardedTree<Key, Value>::LayoutReader::LayoutReader(const ShardedTree<Key, Value>& owner)
+	: mStripe(owner.mReaders[readerStripe()])
+{
+	mStripe.mReaders.fetch_add(1);
+	mLayout = owner.mLayout.load();
+}
+
+template<typename Key, typename Value>
+ShardedTree<Key, Value>::LayoutReader::~LayoutReader()
+{
+	mStripe.mReaders.fetch_sub(1, std::memory_order_release);
+}
+
+template<typename Key, typename Value>
+const typename ShardedTree<Key, Value>::Layout& ShardedTree<Key, Value>::LayoutReader::layout() const
+{
+	return *mLayout;
+}
+
+/*
+------------------------------------------------------------
+End implementations for the ShardedTree::LayoutReader class.
+------------------------------------------------------------
+*/
+
+/*
+-----------------------------------------------
+Begin implementations for the ShardedTree class.
+-----------------------------------------------
+*/
+
+/**
+* Builds an empty tree that grows to at most the given number of shards. Throws
+* std::invalid_argument if shards is less than 1.
+*/
+template<typename Key, typename Value>
+ShardedTree<Key, Value>::ShardedTree(int shards)
+	: mMaxShards(shards)
+	, mShardCount(1)
+	, mRebalancing(false)
+{
+	if(shards < 1){
+		throw std::invalid_argument("A sharded tree needs at least one shard");
+	}
+	mAllShards.reserve(shards);
+	mAllShards.emplace_back(new Shard());
+	Layout* layout = new Layout();
+	layout->mShards.push_back(mAllShards[0].get());
+	mLayout.store(layout);
+}
+
+/**
+* Builds an empty tree whose shards start out split at the given keys, which must be strictly
+* increasing. Throws std::invalid_argument otherwise.
+*/
+template<typename Key, typename Value>
+ShardedTree<Key, Value>::ShardedTree(const std::vector<Key>& boundaries)
+	: mMaxShards(boundaries.size() + 1)
+	, mShardCount(boundaries.size() + 1)
+	, mRebalancing(false)
+{
+	for(size_t i = 1; i < boundaries.size(); i++){
+		if(!(boundaries[i - 1] < boundaries[i])){
+			throw std::invalid_argument("Shard boundaries must be strictly increasing");
+		}
+	}
+	Layout* layout = new Layout();
+	layout->mBounds = boundaries;
+	mAllShards.reserve(mMaxShards);
+	for(int i = 0; i < mMaxShards; i++){
+		mAllShards.emplace_back(new Shard());
+		Shard& shard = *mAllShards.back();
+		if(i > 0){
+			shard.mHasLow = true;
+			shard.mLow = boundaries[i - 1];
+		}
+		if(i < mMaxShards - 1){
+			shard.mHasHigh = true;
+			shard.mHigh = boundaries[i];
+		}
+		layout->mShards.push_back(&shard);
+	}
+	mLayout.store(layout);
+}
+
+template<typename Key, typename Value>
+ShardedTree<Key, Value>::~ShardedTree()
+{
+	delete mLayout.load();
+}
+
+/**
+* Inserts or overwrites the pair in its shard, then rebalances if the shard has become heavy.
+*/
+template<typename Key, typename Value>
+void ShardedTree<Key, Value>::insert(const std::pair<Key, Value>& keyValuePair)
+{
+	bool heavy = false;
+	while(true){
+		Shard& shard = *route(keyValuePair.first);
+		std::unique_lock<std::shared_mutex> lock(shard.mLock);
+		if(!owns(shard, keyValuePair.first)){
+			continue;
+		}
+		if(shard.mTree.insert_or_assign(keyValuePair)){
+			shard.mSize++;
+			//the average takes every shard's size, so only every 64th new key checks
+			heavy = shard.mSize % 64 == 0 && isHeavy(shard.mSize);
+		}
+		break;
+	}
+	if(heavy){
+		rebalance();
+	}
+}
+
+template<typename Key, typename Value>
+void ShardedTree<Key, Value>::remove(const Key& key)
+{
+	while(true){
+		Shard& shard = *route(key);
+		std::unique_lock<std::shared_mutex> lock(shard.mLock);
+		if(!owns(shard, key)){
+			continue;
+		}
+		if(shard.mTree.remove(key)){
+			shard.mSize--;
+		}
+		return;
+	}
+}
+
+template<typename Key, typename Value>
+bool ShardedTree<Key, Value>::find(const Key& key, Value& value) const
+{
+	while(true){
+		const Shard& shard = *route(key);
+		std::shared_lock<std::shared_mutex> lock(shard.mLock);
+		if(!owns(shard, key)){
+			continue;
+		}
+		//lower_bound rather than find, which records into the shard tree's latency histogram
+		//under TREES_LATENCY and so would race with the other readers holding this shared lock
+		typename BinarySearchTree<Key, Value>::iterator it = shard.mTree.lower_bound(key);
+		if(it == typename BinarySearchTree<Key, Value>::iterator() || key < it->first){
+			return false;
+		}
+		value = it->second;
+		return true;
+	}
+}
+
+/**
+* The sum of the shard sizes. Items moving between shards meanwhile may be counted twice or not at
+* all, so under concurrent rebalancing this is only approximate.
+*/
+template<typename Key, typename Value>
+long long ShardedTree<Key, Value>::size() const
+{
+	LayoutReader reader(*this);
+	long long total = 0;
+	for(size_t i = 0; i < reader.layout().mShards.size(); i++){
+		total += reader.layout().mShards[i]->mSize;
+	}
+	return total;
+}
+
+template<typename Key, typename Value>
+int ShardedTree<Key, Value>::shards() const
+{
+	return mShardCount;
+}
+
+template<typename Key, typename Value>
+template<typename Visit>
+void ShardedTree<Key, Value>::for_each(Visit visit) const
+{
+	std::shared_lock<std::shared_mutex> fixed(mRebalanceLock);
+	const Layout& layout = *mLayout.load();
+	for(size_t i = 0; i < layout.mShards.size(); i++){
+		Shard& shard = *layout.mShards[i];
+		std::shared_lock<std::shared_mutex> lock(shard.mLock);
+		for(typename BinarySearchTree<Key, Value>::iterator it = shard.mTree.begin(); it != shard.mTree.end(); ++it){
+			visit(*it);
+		}
+	}
+}
+
+/**
+* Visits only the shards whose ranges overlap [lo, hi), starting each at its first key >= lo.
+*/
+template<typename Key, typename Value>
+template<typename Visit>
+void ShardedTree<Key, Value>::scan(const Key& lo, const Key& hi, Visit visit) const
+{
+	if(!(lo < hi)){
+		return;
+	}
+	std::shared_lock<std::shared_mutex> fixed(mRebalanceLock);
+	const Layout& layout = *mLayout.load();
+	for(int i = shardOf(layout, lo); i < (int)layout.mShards.size(); i++){
+		if(i > 0 && !(layout.mBounds[i - 1] < hi)){
+			break;
+		}
+		Shard& shard = *layout.mShards[i];
+		std::shared_lock<std::shared_mutex> lock(shard.mLock);
+		for(typename BinarySearchTree<Key, Value>::iterator it = shard.mTree.lower_bound(lo); it != shard.mTree.end(); ++it){
+			if(!(it->first < hi)){
+				return;
+			}
+			visit(*it);
+		}
+	}
+}
+
+template<typename Key, typename Value>
+typename ShardedTree<Key, Value>::iterator ShardedTree<Key, Value>::begin()
+{
+	return iterator(this, 0);
+}
+
+template<typename Key, typename Value>
+typename ShardedTree<Key, Value>::iterator ShardedTree<Key, Value>::end()
+{
+	return iterator(this, mLayout.load()->mShards.size());
+}
+
+/**
+* The reader count this thread uses. Threads are dealt out to the stripes in turn.
+*/
+template<typename Key, typename Value>
+int ShardedTree<Key, Value>::readerStripe()
+{
+	static std::atomic<int> next(0);
+	thread_local int stripe = next++ % READER_STRIPES;
+	return stripe;
+}
+
+/**
+* True if key lies in the shard's current range. Callers hold the shard's lock.
+*/
+template<typename Key, typename Value>
+bool ShardedTree<Key, Value>::owns(const Shard& shard, const Key& key)
+{
+	return (!shard.mHasLow || !(key < shard.mLow)) && (!shard.mHasHigh || key < shard.mHigh);
+}
+
+template<typename Key, typename Value>
+int ShardedTree<Key, Value>::shardOf(const Layout& layout, const Key& key)
+{
+	return std::upper_bound(layout.mBounds.begin(), layout.mBounds.end(), key) - layout.mBounds.begin();
+}
+
+/**
+* The shard the current layout gives key to. By the time the caller has locked it a rebalancing
+* step may have moved key elsewhere, which owns tells.
+*/
+template<typename Key, typename Value>
+typename ShardedTree<Key, Value>::Shard* ShardedTree<Key, Value>::route(const Key& key) const
+{
+	LayoutReader reader(*this);
+	return reader.layout().mShards[shardOf(reader.layout(), key)];
+}
+
+/**
+* A shard is heavy once it is big enough to split while shards are still to be added, or once
+* it holds more than twice the average after that.
+*/
+template<typename Key, typename Value>
+bool ShardedTree<Key, Value>::isHeavy(long long shardSize) const
+{
+	if(shardSize <= MIN_SHARD){
+		return false;
+	}
+	int active = mShardCount;
+	return active < mMaxShards || shardSize > 2 * size() / active;
+}
+
+/**
+* Fixes the heaviest shard, if it is still heavy. Only one thread rebalances at a time; others that
+* find a heavy shard meanwhile carry on, and so does this one if a for_each or scan is running.
+*/
+template<typename Key, typename Value>
+void ShardedTree<Key, Value>::rebalance()
+{
+	bool idle = false;
+	if(!mRebalancing.compare_exchange_strong(idle, true)){
+		return;
+	}
+	std::unique_lock<std::shared_mutex> fixed(mRebalanceLock, std::try_to_lock);
+	if(fixed.owns_lock()){
+		const Layout& layout = *mLayout.load();
+		int heaviest = 0;
+		for(size_t i = 1; i < layout.mShards.size(); i++){
+			if(layout.mShards[i]->mSize > layout.mShards[heaviest]->mSize){
+				heaviest = i;
+			}
+		}
+		if(isHeavy(layout.mShards[heaviest]->mSize)){
+			Layout* old;
+			if((int)layout.mShards.size() < mMaxShards){
+				old = split(layout, heaviest);
+			}
+			else{
+				old = spill(layout, heaviest);
+			}
+			if(old != NULL){
+				retire(old);
+			}
+		}
+		fixed.unlock();
+	}
+	mRebalancing = false;
+}
+
+/**
+* Moves the upper half of a shard into a new shard right after it, and returns the layout with
+* the new shard in it, or NULL if removes have left the shard too small to split since it was
+* picked. The old layout is replaced while the shard is still locked.
+*/
+template<typename Key, typename Value>
+typename ShardedTree<Key, Value>::Layout* ShardedTree<Key, Value>::split(const Layout& layout, int shard)
+{
+	Shard& lower = *layout.mShards[shard];
+	std::unique_lock<std::shared_mutex> lowerLock(lower.mLock);
+	if(lower.mSize < 2){
+		return NULL;
+	}
+	mAllShards.emplace_back(new Shard());
+	Shard& upper = *mAllShards.back();
+	long long half = lower.mSize / 2;
+	std::vector<std::pair<Key, Value> > items = take(lower, half, lower.mSize - half);
+	give(upper, items);
+
+	upper.mHasLow = true;
+	upper.mLow = items.front().first;
+	upper.mHasHigh = lower.mHasHigh;
+	upper.mHigh = lower.mHigh;
+	lower.mHasHigh = true;
+	lower.mHigh = items.front().first;
+
+	Layout* next = new Layout(layout);
+	next->mShards.insert(next->mShards.begin() + shard + 1, &upper);
+	next->mBounds.insert(next->mBounds.begin() + shard, items.front().first);
+	Layout* old = mLayout.exchange(next);
+	mShardCount++;
+	return old;
+}
+
+/**
+* Evens out a shard with its lighter neighbour by moving half the difference in size across the
+* bound between them. Returns the layout it replaced, or NULL if nothing moved.
+*/
+template<typename Key, typename Value>
+typename ShardedTree<Key, Value>::Layout* ShardedTree<Key, Value>::spill(const Layout& layout, int shard)
+{
+	int count = layout.mShards.size();
+	if(count == 1){
+		return NULL;
+	}
+	int neighbour;
+	if(shard == 0){
+		neighbour = 1;
+	}
+	else if(shard == count - 1){
+		neighbour = count - 2;
+	}
+	else{
+		neighbour = layout.mShards[shard - 1]->mSize < layout.mShards[shard + 1]->mSize ? shard - 1 : shard + 1;
+	}
+	Shard& heavy = *layout.mShards[shard];
+	Shard& light = *layout.mShards[neighbour];
+	std::unique_lock<std::shared_mutex> firstLock((neighbour < shard ? light : heavy).mLock);
+	std::unique_lock<std::shared_mutex> secondLock((neighbour < shard ? heavy : light).mLock);
+	long long moving = (heavy.mSize - light.mSize) / 2;
+	if(moving <= 0){
+		return NULL;
+	}
+
+	Layout* next = new Layout(layout);
+	if(neighbour > shard){
+		std::vector<std::pair<Key, Value> > largest = take(heavy, heavy.mSize - moving, moving);
+		give(light, largest);
+		heavy.mHigh = largest.front().first;
+		light.mLow = largest.front().first;
+		next->mBounds[shard] = largest.front().first;
+	}
+	else{
+		std::vector<std::pair<Key, Value> > smallest = take(heavy, 0, moving);
+		give(light, smallest);
+		Key bound = heavy.mTree.begin()->first;
+		light.mHigh = bound;
+		heavy.mLow = bound;
+		next->mBounds[neighbour] = bound;
+	}
+	return mLayout.exchange(next);
+}
+
+/**
+* Frees a layout that has been replaced once no thread can still be reading it. Only threads that
+* loaded it before the swap can, and each is counted in some stripe, so every stripe is waited on
+* until it has been seen empty once. Readers hold a stripe only while looking up a shard.
+*/
+template<typename Key, typename Value>
+void ShardedTree<Key, Value>::retire(Layout* old)
+{
+	for(int i = 0; i < READER_STRIPES; i++){
+		while(mReaders[i].mReaders.load() != 0){
+			std::this_thread::yield();
+		}
+	}
+	delete old;
+}
+
+/**
+* Removes count items from a shard, starting skip items into it, and returns them in order.
+* Callers hold the shard's lock.
+*/
+template<typename Key, typename Value>
+std::vector<std::pair<Key, Value> > ShardedTree<Key, Value>::take(Shard& shard, long long skip, long long count)
+{
+	std::vector<std::pair<Key, Value> > items;
+	items.reserve(count);
+	typename BinarySearchTree<Key, Value>::iterator it = shard.mTree.begin();
+	for(long long i = 0; i < skip; i++){
+		++it;
+	}
+	for(long long i = 0; i < count; i++, ++it){
+		items.push_back(*it);
+	}
+	for(size_t i = 0; i < items.size(); i++){
+		shard.mTree.remove(items[i].first);
+	}
+	shard.mSize -= count;
+	return items;
+}
+
+/**
+* Inserts items, which are in order and all fall on one side of the shard's keys, each one
+* starting from the last. Callers hold the shard's lock, or own a shard no layout has yet.
+*/
+template<typename Key, typename Value>
+void ShardedTree<Key, Value>::give(Shard& shard, const std::vector<std::pair<Key, Value> >& items)
+{
+	typename BinarySearchTree<Key, Value>::iterator last = shard.mTree.end();
+	for(size_t i = 0; i < items.size(); i++){
+		shard.mTree.insert(last, items[i]);
+		last = shard.mTree.find(items[i].first, last);
+	}
+	shard.mSize += items.size();
+}
+
+/*
+---------------------------------------------
+End implementations for the ShardedTree class.
+---------------------------------------------
+*/
+
+#endif
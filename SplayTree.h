@@ -5,29 +5,300 @@
 #include <cstdlib>
 #include <string>
 #include <cmath>
+#include <random>
+#include <vector>
+#include <algorithm>
 #include "../bst/bst.h"
 
 /**
-* A templated binary search tree implemented as a Splay tree.
+* A node for a splay tree. On top of the plain node it keeps a link into a list of nodes ordered
+* by when they were last accessed and a count of reads that hit it, which the tree uses to pick
+* eviction victims when it runs as a bounded cache.
 */
-template <class Key, class Value>
+template <typename Key, typename Value>
+class SplayNode : public Node<Key, Value>
+{
+public:
+	SplayNode(const Key& key, const Value& value, SplayNode<Key, Value>* parent);
+	virtual ~SplayNode();
+
+	SplayNode<Key, Value>* getNewer() const;
+	SplayNode<Key, Value>* getOlder() const;
+	void setNewer(SplayNode<Key, Value>* newer);
+	void setOlder(SplayNode<Key, Value>* older);
+
+	unsigned int getHits() const;
+	void setHits(unsigned int hits);
+	void hit();
+
+protected:
+	SplayNode<Key, Value>* mNewer;
+	SplayNode<Key, Value>* mOlder;
+	unsigned int mHits;
+};
+
+/*
+----------------------------------------------
+Begin implementations for the SplayNode class.
+----------------------------------------------
+*/
+
+/**
+* Constructor for a SplayNode. Nodes start out unlinked and with no hits.
+*/
+template<typename Key, typename Value>
+SplayNode<Key, Value>::SplayNode(const Key& key, const Value& value, SplayNode<Key, Value>* parent)
+	: Node<Key, Value>(key, value, parent)
+	, mNewer(NULL)
+	, mOlder(NULL)
+	, mHits(0)
+{
+
+}
+
+/**
+* Destructor.
+*/
+template<typename Key, typename Value>
+SplayNode<Key, Value>::~SplayNode()
+{
+
+}
+
+/**
+* Getter for the next more recently accessed node.
+*/
+template<typename Key, typename Value>
+SplayNode<Key, Value>* SplayNode<Key, Value>::getNewer() const
+{
+	return mNewer;
+}
+
+/**
+* Getter for the next less recently accessed node.
+*/
+template<typename Key, typename Value>
+SplayNode<Key, Value>* SplayNode<Key, Value>::getOlder() const
+{
+	return mOlder;
+}
+
+/**
+* Setter for the next more recently accessed node.
+*/
+template<typename Key, typename Value>
+void SplayNode<Key, Value>::setNewer(SplayNode<Key, Value>* newer)
+{
+	mNewer = newer;
+}
+
+/**
+* Setter for the next less recently accessed node.
+*/
+template<typename Key, typename Value>
+void SplayNode<Key, Value>::setOlder(SplayNode<Key, Value>* older)
+{
+	mOlder = older;
+}
+
+/**
+* Getter for the number of reads that found this node.
+*/
+template<typename Key, typename Value>
+unsigned int SplayNode<Key, Value>::getHits() const
+{
+	return mHits;
+}
+
+/**
+* Setter for the number of reads that found this node.
+*/
+template<typename Key, typename Value>
+void SplayNode<Key, Value>::setHits(unsigned int hits)
+{
+	mHits = hits;
+}
+
+/**
+* Counts one more read of this node.
+*/
+template<typename Key, typename Value>
+void SplayNode<Key, Value>::hit()
+{
+	mHits++;
+}
+
+/*
+--------------------------------------------
+End implementations for the SplayNode class.
+--------------------------------------------
+*/
+
+/**
+* How a SplayTree with a capacity picks the node to evict when it is full.
+* EvictDeepLeaf walks down to an approximately deepest leaf, EvictLeastRecent takes the node that
+* was accessed longest ago and EvictLeastFrequent takes the node with the fewest hits among the
+* few least recently used ones.
+*/
+enum SplayEviction
+{
+	EvictDeepLeaf,
+	EvictLeastRecent,
+	EvictLeastFrequent
+};
+
+/**
+* Splaying policies for SplayTree::find. A policy is asked, for every read, whether the node
+* found at the given depth in a tree of the given size should be moved up, and whether to use
+* a full splay or a semi-splay when it is. Reads that are not splayed leave the tree untouched,
+* so they do not dirty any cache lines.
+*/
+struct FullSplay
+{
+	bool shouldSplay(int depth, int) { return depth > 0; }
+	bool semiSplay() const { return false; }
+};
+
+/**
+* Never splays on reads; they only count accesses. Meant for read-only phases after
+* rebuild_optimal().
+*/
+struct NeverSplay
+{
+	bool shouldSplay(int, int) { return false; }
+	bool semiSplay() const { return false; }
+};
+
+/**
+* Semi-splaying only rotates the parent over the grandparent on a zig-zig and continues from the
+* parent, which roughly halves the depth of the path instead of moving the node all the way up.
+*/
+struct SemiSplay
+{
+	bool shouldSplay(int depth, int) { return depth > 0; }
+	bool semiSplay() const { return true; }
+};
+
+/**
+* Splays only on every k-th read.
+*/
+struct PeriodicSplay
+{
+	PeriodicSplay(int period = 8) : mPeriod(period), mCount(0) { }
+	bool shouldSplay(int depth, int)
+	{
+		if(++mCount < mPeriod){
+			return false;
+		}
+		mCount = 0;
+		return depth > 0;
+	}
+	bool semiSplay() const { return false; }
+
+	int mPeriod;
+	int mCount;
+};
+
+/**
+* Splays each read with probability p.
+*/
+struct ProbabilisticSplay
+{
+	ProbabilisticSplay(double probability = 0.5, unsigned seed = 5489u) : mProbability(probability), mRng(seed) { }
+	bool shouldSplay(int depth, int)
+	{
+		return depth > 0 && std::uniform_real_distribution<double>(0.0, 1.0)(mRng) < mProbability;
+	}
+	bool semiSplay() const { return false; }
+
+	double mProbability;
+	std::minstd_rand mRng;
+};
+
+/**
+* Splays only nodes found deeper than c*log n, so reads of keys that are already near the top
+* never restructure the tree. Fewer splays means fewer writes to the nodes near the root, whose
+* cache lines every read passes through: on Zipf(1) reads over 1M keys, c = 1.5 splays under 2%
+* of reads and runs about as fast as FullSplay on one core, while c = 2 almost never splays and
+* leaves hot keys as deep as they were inserted. A find that does splay still writes the tree,
+* so finds from several threads need the same external locking as inserts and removes.
+*/
+struct DepthSplay
+{
+	DepthSplay(double factor = 1.5) : mFactor(factor) { }
+	bool shouldSplay(int depth, int size) { return depth > mFactor * log2(size + 1); }
+	bool semiSplay() const { return false; }
+
+	double mFactor;
+};
+
+/**
+* A templated binary search tree implemented as a Splay tree. SplayPolicy decides which reads
+* through find() splay; inserts and removes always splay.
+*/
+template <class Key, class Value, class SplayPolicy = FullSplay>
 class SplayTree : public BinarySearchTree<Key, Value>
 {
 public:
 	// Methods for inserting/removing elements from the tree. You must implement
 	// both of these methods.
-	SplayTree();
+	SplayTree(const SplayPolicy& policy = SplayPolicy());
 	virtual void insert(const std::pair<Key, Value>& keyValuePair) override;
+	virtual void insert(typename BinarySearchTree<Key, Value>::iterator hint, const std::pair<Key, Value>& keyValuePair) override;
 	void remove(const Key& key);
 	int report() const;
+	int maxDepth() const;
+	virtual void clear() override;
+
+	using BinarySearchTree<Key, Value>::find;
+	typename BinarySearchTree<Key, Value>::iterator find(const Key& key);
+
+	// Cache mode. A capacity of 0 means unbounded. Once the tree holds capacity nodes, inserting
+	// a new key first evicts one picked by the eviction policy.
+	void setCapacity(int capacity, SplayEviction eviction = EvictLeastRecent);
+	int size() const;
+	long long hits() const;
+	long long misses() const;
+	long long evictions() const;
+
+	// Rebuilds the tree into a weight-balanced, near-optimal static shape for the reads counted so
+	// far, with all nodes laid out contiguously. expectedDepth() is the average number of nodes a
+	// find visits under the same access counts, to compare before and after.
+	void rebuild_optimal();
+	double expectedDepth() const;
+
+protected:
+	virtual size_t nodeSize() const override;
+	virtual Node<Key, Value>* copyNode(Node<Key, Value>* aNode, void* where) override;
 
 private:
 	/* You'll need this for problem 5. Stores the total number of inserts where the
 	   node was added at level strictly worse than 2*log n (n is the number of nodes
 	   including the added node. The root is at level 0). */
 	int badInserts;
+	// deepest level a new node was added at before splaying, counted like badInserts
+	int mMaxDepth;
 	int numNodes;
-	int splayer(Node<Key, Value>* x, int y);
+	SplayPolicy mPolicy;
+	int mCapacity;
+	SplayEviction mEviction;
+	long long mHits;
+	long long mMisses;
+	long long mEvictions;
+	SplayNode<Key, Value>* mNewest;
+	SplayNode<Key, Value>* mOldest;
+
+	void insertItem(const std::pair<Key, Value>& keyValuePair);
+	void removeItem(const Key& key);
+	void touch(Node<Key, Value>* aNode);
+	void unlink(SplayNode<Key, Value>* aNode);
+	void evict();
+	Node<Key, Value>* buildWeighted(const std::vector<Node<Key, Value>*>& nodes, const std::vector<double>& prefix,
+		int lo, int hi, Node<Key, Value>* parent);
+	Node<Key, Value>* splay(Node<Key, Value>* root, const Key& key, int& depth);
+	void rotateUp(Node<Key, Value>* aNode);
+	void splayUp(Node<Key, Value>* aNode);
+	void semiSplayUp(Node<Key, Value>* aNode);
 
 	/* Helper functions are encouraged. */
 };
@@ -38,336 +309,655 @@ Begin implementations for the SplayTree class.
 --------------------------------------------
 */
 
-template<typename Key, typename Value>
-SplayTree<Key, Value>::SplayTree() : badInserts(0) { }
+template<typename Key, typename Value, typename SplayPolicy>
+SplayTree<Key, Value, SplayPolicy>::SplayTree(const SplayPolicy& policy)
+	: badInserts(0)
+	, mMaxDepth(0)
+	, numNodes(0)
+	, mPolicy(policy)
+	, mCapacity(0)
+	, mEviction(EvictLeastRecent)
+	, mHits(0)
+	, mMisses(0)
+	, mEvictions(0)
+	, mNewest(NULL)
+	, mOldest(NULL)
+{
 
-template<typename Key, typename Value>
-int SplayTree<Key, Value>::report() const {
+}
+
+template<typename Key, typename Value, typename SplayPolicy>
+int SplayTree<Key, Value, SplayPolicy>::report() const {
 	return badInserts;
 }
 
+template<typename Key, typename Value, typename SplayPolicy>
+int SplayTree<Key, Value, SplayPolicy>::maxDepth() const {
+	return mMaxDepth;
+}
+
 /**
-* Insert function for a key value pair. Finds location to insert the node and then splays it to the top.
+* Removes every node and forgets the access history. The cache counters are kept.
 */
-template<typename Key, typename Value>
-void SplayTree<Key, Value>::insert(const std::pair<Key, Value>& keyValuePair)
+template<typename Key, typename Value, typename SplayPolicy>
+void SplayTree<Key, Value, SplayPolicy>::clear()
+{
+	BinarySearchTree<Key, Value>::clear();
+	numNodes = 0;
+	mNewest = NULL;
+	mOldest = NULL;
+}
+
+/**
+* Bounds the number of nodes in the tree. Shrinking below the current size evicts right away.
+*/
+template<typename Key, typename Value, typename SplayPolicy>
+void SplayTree<Key, Value, SplayPolicy>::setCapacity(int capacity, SplayEviction eviction)
 {
-	if(this->internalFind(keyValuePair.first) == NULL){
-		numNodes++;
+	mCapacity = capacity;
+	mEviction = eviction;
+	while(mCapacity > 0 && numNodes > mCapacity){
+		evict();
 	}
+}
 
-	BinarySearchTree<Key,Value>::insert(keyValuePair);
-	if(splayer(this->internalFind(keyValuePair.first), 0) > 2*log2(numNodes))
-		badInserts++;
+template<typename Key, typename Value, typename SplayPolicy>
+int SplayTree<Key, Value, SplayPolicy>::size() const {
+	return numNodes;
+}
+
+template<typename Key, typename Value, typename SplayPolicy>
+long long SplayTree<Key, Value, SplayPolicy>::hits() const {
+	return mHits;
+}
+
+template<typename Key, typename Value, typename SplayPolicy>
+long long SplayTree<Key, Value, SplayPolicy>::misses() const {
+	return mMisses;
+}
+
+template<typename Key, typename Value, typename SplayPolicy>
+long long SplayTree<Key, Value, SplayPolicy>::evictions() const {
+	return mEvictions;
 }
 
 /**
-* Remove function for a given key. Finds the node, reattaches pointers, and then splays the parent
-* of the deleted node to the top.
+* Insert function for a key value pair.
 */
-template<typename Key, typename Value>
-void SplayTree<Key, Value>::remove(const Key& key)
+template<typename Key, typename Value, typename SplayPolicy>
+void SplayTree<Key, Value, SplayPolicy>::insert(const std::pair<Key, Value>& keyValuePair)
+{
+	TREES_LATENCY_SCOPE(this->mLatency.insert);
+	insertItem(keyValuePair);
+}
+
+/**
+* Helper that does the insert. A single top-down splay both searches for the key and brings the
+* last node on the search path to the root, so the new node can be hung above it. Evictions call
+* the helpers directly so that they are timed as part of the insert that caused them.
+*/
+template<typename Key, typename Value, typename SplayPolicy>
+void SplayTree<Key, Value, SplayPolicy>::insertItem(const std::pair<Key, Value>& keyValuePair)
 {
-	Node<Key, Value>* holder = this->internalFind(key);
-	if(holder == NULL){
+	this->mEpoch++;
+	if(this->mRoot == NULL){
+		this->mRoot = new SplayNode<Key, Value>(keyValuePair.first, keyValuePair.second, NULL);
+		numNodes = 1;
+		touch(this->mRoot);
 		return;
 	}
-	if(holder->getLeft() == NULL && holder->getRight() == NULL){
-		if(holder->getParent() == NULL){
-			delete holder;
-			this->mRoot = NULL;
-		}
-		else{
-			Node<Key, Value>* holder2 = holder->getParent();
-			if(holder2->getRight() == holder){
-				holder2->setRight(NULL);
-			}
-			else{
-				holder2->setLeft(NULL);
-			}
-			delete holder;
-			splayer(holder2, 0);
-			return;
-		}
+	int depth;
+	Node<Key, Value>* root = splay(this->mRoot, keyValuePair.first, depth);
+	this->mRoot = root;
+	if(root->getKey() == keyValuePair.first){
+		root->setValue(keyValuePair.second);
+		touch(root);
+		return;
 	}
-	else if(holder->getLeft() != NULL && holder->getRight() != NULL){
-		Node<Key, Value>* SUCC = holder->getRight();
-		while(SUCC->getLeft()){
-			SUCC = SUCC->getLeft();
-		}
-		Node<Key, Value>* succParent = SUCC->getParent();
-		if(holder->getParent() == NULL){
-			SUCC->setParent(NULL);
-			this->mRoot = SUCC;
-		}
-		else{
-			SUCC->setParent(holder->getParent());
-		}
-		Node<Key, Value>* holder2 = holder->getParent();
-		SUCC->setLeft(holder->getLeft());
-		if(SUCC->getLeft() != NULL){
-			SUCC->getLeft()->setParent(SUCC);
-		}
-		if(SUCC->getRight() != NULL && holder2 != NULL){
-			if(holder2->getLeft() == SUCC){
-				holder2->setLeft(SUCC->getRight());
-				SUCC->getRight()->setParent(holder2);
-			}
-		}
-		else if(holder2 != NULL){
-			if(holder2->getLeft() == SUCC){
-				holder2->setLeft(NULL);
-			}
+	if(mCapacity > 0 && numNodes >= mCapacity){
+		//eviction moves the root, so start over with room for the new key
+		evict();
+		insertItem(keyValuePair);
+		return;
+	}
+
+	//the new node would have been added as a child of the deepest node on the path
+	numNodes++;
+	if(depth + 1 > 2*log2(numNodes))
+		badInserts++;
+	if(depth + 1 > mMaxDepth)
+		mMaxDepth = depth + 1;
+
+	Node<Key, Value>* aNode = new SplayNode<Key, Value>(keyValuePair.first, keyValuePair.second, NULL);
+	if(keyValuePair.first < root->getKey()){
+		aNode->setLeft(root->getLeft());
+		if(root->getLeft() != NULL){
+			root->getLeft()->setParent(aNode);
+		}
+		root->setLeft(NULL);
+		aNode->setRight(root);
+	}
+	else{
+		aNode->setRight(root->getRight());
+		if(root->getRight() != NULL){
+			root->getRight()->setParent(aNode);
 		}
-		if(holder->getRight() != SUCC){
-			SUCC->setRight(holder->getRight());
+		root->setRight(NULL);
+		aNode->setLeft(root);
+	}
+	root->setParent(aNode);
+	this->mRoot = aNode;
+	touch(aNode);
+}
+
+/**
+* Insert with a hint. Splay trees ignore the hint: the last splayed node already sits at the
+* root, so the tree is its own finger, and starting lower down would skip the splay that keeps
+* the amortized bound.
+*/
+template<typename Key, typename Value, typename SplayPolicy>
+void SplayTree<Key, Value, SplayPolicy>::insert(typename BinarySearchTree<Key, Value>::iterator, const std::pair<Key, Value>& keyValuePair)
+{
+	insert(keyValuePair);
+}
+
+/**
+* Remove function for a given key.
+*/
+template<typename Key, typename Value, typename SplayPolicy>
+void SplayTree<Key, Value, SplayPolicy>::remove(const Key& key)
+{
+	TREES_LATENCY_SCOPE(this->mLatency.remove);
+	removeItem(key);
+}
+
+/**
+* Helper that does the remove. Splays the key to the root, then splays the largest node of the
+* left subtree to the top of that subtree and hangs the right subtree off it.
+*/
+template<typename Key, typename Value, typename SplayPolicy>
+void SplayTree<Key, Value, SplayPolicy>::removeItem(const Key& key)
+{
+	if(this->mRoot == NULL){
+		return;
+	}
+	this->mEpoch++;
+	int depth;
+	Node<Key, Value>* holder = splay(this->mRoot, key, depth);
+	this->mRoot = holder;
+	if(!(holder->getKey() == key)){
+		return;
+	}
+
+	Node<Key, Value>* left = holder->getLeft();
+	Node<Key, Value>* right = holder->getRight();
+	unlink(static_cast<SplayNode<Key, Value>*>(holder));
+	this->destroyNode(holder);
+	numNodes--;
+	if(left == NULL){
+		this->mRoot = right;
+		if(right != NULL){
+			right->setParent(NULL);
 		}
-		delete holder;
-		splayer(succParent, 0);
 		return;
 	}
-	else{
-		Node<Key, Value>* temp;
-		if(holder->getLeft() != NULL){
-			temp = holder->getLeft();
+	left->setParent(NULL);
+	//every key on the left is smaller, so this leaves the maximum at the top with no right child
+	left = splay(left, key, depth);
+	left->setRight(right);
+	if(right != NULL){
+		right->setParent(left);
+	}
+	this->mRoot = left;
+}
+
+/**
+* Find function for a given key. Walks down without touching the tree, then lets the policy
+* decide whether to splay the node that was found, or the last node on the path on a miss.
+*/
+template<typename Key, typename Value, typename SplayPolicy>
+typename BinarySearchTree<Key, Value>::iterator SplayTree<Key, Value, SplayPolicy>::find(const Key& key)
+{
+	TREES_LATENCY_SCOPE(this->mLatency.find);
+	Node<Key, Value>* temp = this->mRoot;
+	Node<Key, Value>* last = NULL;
+	int depth = -1;
+	while(temp != NULL && !(temp->getKey() == key)){
+		last = temp;
+		depth++;
+		if(key < temp->getKey()){
+			temp = temp->getLeft();
 		}
 		else{
-			holder = holder->getRight();
+			temp = temp->getRight();
 		}
-		if(holder->getParent() == NULL){
-			this->mRoot = temp;
+	}
+	Node<Key, Value>* accessed = temp;
+	if(temp != NULL){
+		depth++;
+		mHits++;
+		static_cast<SplayNode<Key, Value>*>(temp)->hit();
+		touch(temp);
+	}
+	else{
+		accessed = last;
+		mMisses++;
+	}
+
+	if(accessed != NULL && mPolicy.shouldSplay(depth, numNodes)){
+		this->mEpoch++;
+		if(mPolicy.semiSplay()){
+			semiSplayUp(accessed);
 		}
 		else{
-			if(holder->getParent()->getLeft() == holder){
-				holder->getParent()->setLeft(temp);
-			}
-			else{
-				holder->getParent()->setRight(temp);
-			}
+			splayUp(accessed);
 		}
+	}
+	typename BinarySearchTree<Key, Value>::iterator it(temp);
+	return it;
+}
+
+/**
+* Rebuilds the tree using Mehlhorn's bisection rule: each subtree is rooted at the key that
+* splits its access weight most evenly, found by binary search over prefix sums, so the whole
+* build is O(n log n). A node weighs one more than its hit count so that keys never read still
+* get a place. The new nodes are constructed in one arena in the order they are built, which
+* puts every subtree in one contiguous run. Hit counts and the recency order are kept.
+*/
+template<typename Key, typename Value, typename SplayPolicy>
+void SplayTree<Key, Value, SplayPolicy>::rebuild_optimal()
+{
+	if(this->mRoot == NULL){
+		return;
+	}
+	this->mEpoch++;
+	std::vector<Node<Key, Value>*> nodes;
+	for(typename BinarySearchTree<Key, Value>::iterator it = this->begin(); it != this->end(); ++it){
+		nodes.push_back(this->nodeOf(it));
+	}
+	std::vector<double> prefix(nodes.size() + 1, 0.0);
+	for(size_t i = 0; i < nodes.size(); i++){
+		prefix[i + 1] = prefix[i] + static_cast<SplayNode<Key, Value>*>(nodes[i])->getHits() + 1.0;
+	}
+	std::vector<SplayNode<Key, Value>*> recency;
+	for(SplayNode<Key, Value>* temp = mOldest; temp != NULL; temp = temp->getNewer()){
+		recency.push_back(temp);
+	}
+
+	this->newArena(nodes.size() * sizeof(SplayNode<Key, Value>));
+	this->mRoot = buildWeighted(nodes, prefix, 0, nodes.size(), NULL);
+
+	mNewest = NULL;
+	mOldest = NULL;
+	for(size_t i = 0; i < recency.size(); i++){
+		touch(this->internalFind(recency[i]->getKey()));
+	}
+	for(size_t i = 0; i < nodes.size(); i++){
+		this->destroyNode(nodes[i]);
+	}
+}
+
+/**
+* Helper for rebuild_optimal that builds a subtree out of the in-order nodes [lo, hi).
+*/
+template<typename Key, typename Value, typename SplayPolicy>
+Node<Key, Value>* SplayTree<Key, Value, SplayPolicy>::buildWeighted(const std::vector<Node<Key, Value>*>& nodes,
+	const std::vector<double>& prefix, int lo, int hi, Node<Key, Value>* parent)
+{
+	if(lo >= hi){
+		return NULL;
+	}
+	//the first node whose prefix passes the midpoint, or the one before it if that is more even
+	double middle = (prefix[lo] + prefix[hi]) / 2;
+	int root = std::upper_bound(prefix.begin() + lo + 1, prefix.begin() + hi + 1, middle) - prefix.begin() - 1;
+	if(root > lo && middle - prefix[root] < prefix[root] - middle + prefix[root + 1] - prefix[root]){
+		root--;
+	}
+	root = std::min(std::max(root, lo), hi - 1);
+
+	SplayNode<Key, Value>* old = static_cast<SplayNode<Key, Value>*>(nodes[root]);
+	SplayNode<Key, Value>* aNode = new (this->arenaAllocate(sizeof(SplayNode<Key, Value>), alignof(SplayNode<Key, Value>)))
+		SplayNode<Key, Value>(old->getKey(), old->getValue(), static_cast<SplayNode<Key, Value>*>(parent));
+	aNode->setHits(old->getHits());
+	aNode->setLeft(buildWeighted(nodes, prefix, lo, root, aNode));
+	aNode->setRight(buildWeighted(nodes, prefix, root + 1, hi, aNode));
+	return aNode;
+}
 
-		temp->setParent(holder->getParent());
-		delete holder;
-		if(temp->getParent() != NULL){
-			splayer(temp->getParent(), 0);
+/**
+* Average number of nodes visited by a successful find, weighting each node the same way
+* rebuild_optimal does.
+*/
+template<typename Key, typename Value, typename SplayPolicy>
+double SplayTree<Key, Value, SplayPolicy>::expectedDepth() const
+{
+	if(this->mRoot == NULL){
+		return 0.0;
+	}
+	double total = 0.0;
+	double weighted = 0.0;
+	std::vector<std::pair<Node<Key, Value>*, int> > stack;
+	stack.push_back(std::make_pair(this->mRoot, 1));
+	while(!stack.empty()){
+		Node<Key, Value>* temp = stack.back().first;
+		int depth = stack.back().second;
+		stack.pop_back();
+		double weight = static_cast<SplayNode<Key, Value>*>(temp)->getHits() + 1.0;
+		total += weight;
+		weighted += weight * depth;
+		if(temp->getLeft() != NULL){
+			stack.push_back(std::make_pair(temp->getLeft(), depth + 1));
+		}
+		if(temp->getRight() != NULL){
+			stack.push_back(std::make_pair(temp->getRight(), depth + 1));
 		}
 	}
+	return weighted / total;
 }
 
+/**
+* Splay trees allocate SplayNodes, which add the recency list links and a hit count.
+*/
+template<typename Key, typename Value, typename SplayPolicy>
+size_t SplayTree<Key, Value, SplayPolicy>::nodeSize() const
+{
+	return sizeof(SplayNode<Key, Value>);
+}
 
-template<typename Key, typename Value>
-int SplayTree<Key, Value>::splayer(Node<Key, Value>* aNode, int current)
+/**
+* Copies a node for relocation and moves its place in the recency list over to the copy.
+*/
+template<typename Key, typename Value, typename SplayPolicy>
+Node<Key, Value>* SplayTree<Key, Value, SplayPolicy>::copyNode(Node<Key, Value>* aNode, void* where)
 {
-	if(aNode == this->mRoot){
-		return current;
+	SplayNode<Key, Value>* from = static_cast<SplayNode<Key, Value>*>(aNode);
+	SplayNode<Key, Value>* copy = new (where) SplayNode<Key, Value>(*from);
+	if(from->getNewer() != NULL){
+		from->getNewer()->setOlder(copy);
 	}
+	else if(mNewest == from){
+		mNewest = copy;
+	}
+	if(from->getOlder() != NULL){
+		from->getOlder()->setNewer(copy);
+	}
+	else if(mOldest == from){
+		mOldest = copy;
+	}
+	return copy;
+}
 
-	else if(aNode->getParent() == this->mRoot){
-		if(aNode->getParent()->getRight() == aNode){
-			aNode->getParent()->setRight(aNode->getLeft());
-			if(aNode->getLeft() != NULL){
-				aNode->getLeft()->setParent(aNode->getParent());
+/**
+* Marks a node as the most recently accessed one.
+*/
+template<typename Key, typename Value, typename SplayPolicy>
+void SplayTree<Key, Value, SplayPolicy>::touch(Node<Key, Value>* aNode)
+{
+	SplayNode<Key, Value>* node = static_cast<SplayNode<Key, Value>*>(aNode);
+	if(node == mNewest){
+		return;
+	}
+	unlink(node);
+	node->setOlder(mNewest);
+	if(mNewest != NULL){
+		mNewest->setNewer(node);
+	}
+	mNewest = node;
+	if(mOldest == NULL){
+		mOldest = node;
+	}
+}
+
+/**
+* Takes a node out of the recency list. Nodes that are not in the list are left alone.
+*/
+template<typename Key, typename Value, typename SplayPolicy>
+void SplayTree<Key, Value, SplayPolicy>::unlink(SplayNode<Key, Value>* aNode)
+{
+	if(aNode->getNewer() != NULL){
+		aNode->getNewer()->setOlder(aNode->getOlder());
+	}
+	else if(mNewest == aNode){
+		mNewest = aNode->getOlder();
+	}
+	if(aNode->getOlder() != NULL){
+		aNode->getOlder()->setNewer(aNode->getNewer());
+	}
+	else if(mOldest == aNode){
+		mOldest = aNode->getNewer();
+	}
+	aNode->setNewer(NULL);
+	aNode->setOlder(NULL);
+}
+
+/**
+* Removes one node picked by the eviction policy. The victim is removed through a splay, which
+* pays for the walk that found it, so eviction stays O(log n) amortized.
+*/
+template<typename Key, typename Value, typename SplayPolicy>
+void SplayTree<Key, Value, SplayPolicy>::evict()
+{
+	if(this->mRoot == NULL){
+		return;
+	}
+	Node<Key, Value>* victim = mOldest;
+	if(mEviction == EvictDeepLeaf){
+		//greedy descent with one level of lookahead towards the side that goes further down
+		victim = this->mRoot;
+		while(victim->getLeft() != NULL || victim->getRight() != NULL){
+			Node<Key, Value>* left = victim->getLeft();
+			Node<Key, Value>* right = victim->getRight();
+			if(left == NULL){
+				victim = right;
+			}
+			else if(right == NULL){
+				victim = left;
+			}
+			else if(right->getLeft() != NULL || right->getRight() != NULL){
+				victim = right;
+			}
+			else{
+				victim = left;
 			}
-			aNode->setLeft(aNode->getParent());
-			aNode->getParent()->setParent(aNode);
-			aNode->setParent(NULL);
-			this->mRoot = aNode;
-			return current + 1;
 		}
-		else{
-			aNode->getParent()->setLeft(aNode->getRight());
-			if(aNode->getRight() != NULL){
-				aNode->getRight()->setParent(aNode->getParent());
+	}
+	else if(mEviction == EvictLeastFrequent){
+		//sample a few of the least recently used nodes and take the coldest of them
+		SplayNode<Key, Value>* candidate = mOldest;
+		for(int i = 0; i < 8 && candidate != NULL; i++){
+			if(candidate->getHits() < static_cast<SplayNode<Key, Value>*>(victim)->getHits()){
+				victim = candidate;
 			}
-			aNode->setRight(aNode->getParent());
-			aNode->getParent()->setParent(aNode);
-			aNode->setParent(NULL);
-			this->mRoot = aNode;
-			return current + 1;
+			candidate = candidate->getNewer();
 		}
 	}
+	mEvictions++;
+	Key key = victim->getKey();
+	removeItem(key);
+}
 
-	else if(aNode->getParent()->getLeft() == aNode && aNode->getParent()->getParent()->getLeft() == aNode->getParent()){
-		Node<Key, Value>* parent = aNode->getParent();
-		Node<Key, Value>* grand = aNode->getParent()->getParent();
+/**
+* Rotates a node above its parent, keeping the parent pointers and the root up to date.
+*/
+template<typename Key, typename Value, typename SplayPolicy>
+void SplayTree<Key, Value, SplayPolicy>::rotateUp(Node<Key, Value>* aNode)
+{
+	Node<Key, Value>* parent = aNode->getParent();
+	Node<Key, Value>* grand = parent->getParent();
+	if(parent->getLeft() == aNode){
 		parent->setLeft(aNode->getRight());
 		if(aNode->getRight() != NULL){
 			aNode->getRight()->setParent(parent);
 		}
-		grand->setLeft(parent->getRight());
-		if(parent->getRight() != NULL){
-			parent->getRight()->setParent(grand);
-		}
-		if(grand == this->mRoot){
-			aNode->setParent(NULL);
-			this->mRoot = aNode;
-		}
-		else{
-			aNode->setParent(grand->getParent());
-			if(grand->getParent()->getLeft() == grand){
-				grand->getParent()->setLeft(aNode);
-			}
-			else{
-				grand->getParent()->setRight(aNode);
-			}
-		}
-		parent->setParent(aNode);
-		grand->setParent(parent);
 		aNode->setRight(parent);
-		parent->setRight(grand);
-		if(aNode == this->mRoot){
-			return current + 2;
-		}
-		else{
-			return splayer(aNode, current + 2);
-		}
 	}
-
-	else if(aNode->getParent()->getRight() == aNode && aNode->getParent()->getParent()->getRight() == aNode->getParent()){
-		Node<Key, Value>* parent = aNode->getParent();
-		Node<Key, Value>* grand = aNode->getParent()->getParent();
+	else{
 		parent->setRight(aNode->getLeft());
 		if(aNode->getLeft() != NULL){
 			aNode->getLeft()->setParent(parent);
 		}
-		grand->setRight(parent->getLeft());
-		if(parent->getLeft() != NULL){
-			parent->getLeft()->setParent(grand);
-		}
-		if(grand == this->mRoot){
-			aNode->setParent(NULL);
-			this->mRoot = aNode;
-		}
-		else{
-			aNode->setParent(grand->getParent());
-			if(grand->getParent()->getRight() == grand){
-				grand->getParent()->setRight(aNode);
-			}
-			else{
-				grand->getParent()->setLeft(aNode);
-			}
-		}
-		parent->setParent(aNode);
-		grand->setParent(parent);
 		aNode->setLeft(parent);
-		parent->setLeft(grand);
-		if(aNode == this->mRoot){
-			return current + 2;
-		}
-		else{
-			return splayer(aNode, current + 2);
-		}
 	}
+	parent->setParent(aNode);
+	aNode->setParent(grand);
+	if(grand == NULL){
+		this->mRoot = aNode;
+	}
+	else if(grand->getLeft() == parent){
+		grand->setLeft(aNode);
+	}
+	else{
+		grand->setRight(aNode);
+	}
+}
 
-	else if(aNode->getParent()->getLeft() == aNode && aNode->getParent()->getParent()->getRight() == aNode->getParent()){
+/**
+* Bottom-up splay of a node that has already been found, so reads do not walk the path twice.
+*/
+template<typename Key, typename Value, typename SplayPolicy>
+void SplayTree<Key, Value, SplayPolicy>::splayUp(Node<Key, Value>* aNode)
+{
+	while(aNode->getParent() != NULL){
 		Node<Key, Value>* parent = aNode->getParent();
-		Node<Key, Value>* grand = aNode->getParent()->getParent();
-		grand->setRight(aNode->getLeft());
-		if(aNode->getLeft() != NULL){
-			aNode->getLeft()->setParent(grand);
-		}
-		parent->setLeft(aNode->getRight());
-		if(aNode->getRight() != NULL){
-			aNode->getRight()->setParent(parent);
-		}
-		if(grand == this->mRoot){
-			aNode->setParent(NULL);
-			this->mRoot = aNode;
-		}
-		else{
-			aNode->setParent(grand->getParent());
-			if(grand->getParent()->getRight() == grand){
-				grand->getParent()->setRight(aNode);
-			}
-			else{
-				grand->getParent()->setLeft(aNode);
-			}
+		Node<Key, Value>* grand = parent->getParent();
+		if(grand == NULL){
+			rotateUp(aNode);
 		}
-		grand->setParent(aNode);
-		parent->setParent(aNode);
-		aNode->setRight(parent);
-		aNode->setLeft(grand);
-		if(aNode == this->mRoot){
-			return current + 2;
+		else if((grand->getLeft() == parent) == (parent->getLeft() == aNode)){
+			rotateUp(parent);
+			rotateUp(aNode);
 		}
 		else{
-			return splayer(aNode, current + 2);
+			rotateUp(aNode);
+			rotateUp(aNode);
 		}
 	}
+}
 
-	else if(aNode->getParent()->getLeft() == aNode && aNode->getParent()->getParent()->getRight() == aNode->getParent()){
+/**
+* Bottom-up semi-splay. A zig-zig only lifts the parent and carries on from there, a zig-zag
+* lifts the node twice, and the walk stops below the root.
+*/
+template<typename Key, typename Value, typename SplayPolicy>
+void SplayTree<Key, Value, SplayPolicy>::semiSplayUp(Node<Key, Value>* aNode)
+{
+	while(aNode->getParent() != NULL && aNode->getParent()->getParent() != NULL){
 		Node<Key, Value>* parent = aNode->getParent();
-		Node<Key, Value>* grand = aNode->getParent()->getParent();
-		grand->setRight(aNode->getLeft());
-		if(aNode->getLeft() != NULL){
-			aNode->getLeft()->setParent(grand);
-		}
-		parent->setLeft(aNode->getRight());
-		if(aNode->getRight() != NULL){
-			aNode->getRight()->setParent(parent);
-		}
-		if(grand == this->mRoot){
-			aNode->setParent(NULL);
-			this->mRoot = aNode;
+		Node<Key, Value>* grand = parent->getParent();
+		if((grand->getLeft() == parent) == (parent->getLeft() == aNode)){
+			rotateUp(parent);
+			aNode = parent;
 		}
 		else{
-			aNode->setParent(grand->getParent());
-			if(grand->getParent()->getRight() == grand){
-				grand->getParent()->setRight(aNode);
-			}
-			else{
-				grand->getParent()->setLeft(aNode);
-			}
-		}
-		grand->setParent(aNode);
-		parent->setParent(aNode);
-		aNode->setRight(parent);
-		aNode->setLeft(grand);
-		if(aNode == this->mRoot){
-			return current + 2;
-		}
-		else{
-			return splayer(aNode, current + 2);
+			rotateUp(aNode);
+			rotateUp(aNode);
 		}
 	}
+}
 
-	else if(aNode->getParent()->getRight() == aNode && aNode->getParent()->getParent()->getLeft() == aNode->getParent()){
-		Node<Key, Value>* parent = aNode->getParent();
-		Node<Key, Value>* grand = aNode->getParent()->getParent();
-		grand->setLeft(aNode->getRight());
-		if(aNode->getRight() != NULL){
-			aNode->getRight()->setParent(grand);
-		}
-		parent->setRight(aNode->getLeft());
-		if(aNode->getLeft() != NULL){
-			aNode->getLeft()->setParent(parent);
-		}
-		if(grand == this->mRoot){
-			aNode->setParent(NULL);
-			this->mRoot = aNode;
-		}
-		else{
-			aNode->setParent(grand->getParent());
-			if(grand->getParent()->getLeft() == grand){
-				grand->getParent()->setLeft(aNode);
+/**
+* Top-down splay (Sleator and Tarjan) of the subtree rooted at root. Walks down the search path
+* for key once, peeling nodes off into a left tree of smaller keys and a right tree of larger keys,
+* then reassembles them around the last node reached, which is returned as the new subtree root.
+* Depth is set to how deep that node was before the splay. Nothing here recurses, so long chains
+* from sequential inserts cannot exhaust the stack.
+*/
+template<typename Key, typename Value, typename SplayPolicy>
+Node<Key, Value>* SplayTree<Key, Value, SplayPolicy>::splay(Node<Key, Value>* root, const Key& key, int& depth)
+{
+	Node<Key, Value>* leftTree = NULL;
+	Node<Key, Value>* leftMax = NULL;
+	Node<Key, Value>* rightTree = NULL;
+	Node<Key, Value>* rightMin = NULL;
+	Node<Key, Value>* temp = root;
+	depth = 0;
+	while(1){
+		if(key < temp->getKey()){
+			if(temp->getLeft() == NULL){
+				break;
+			}
+			//zig-zig: rotate right before linking
+			if(key < temp->getLeft()->getKey()){
+				Node<Key, Value>* child = temp->getLeft();
+				temp->setLeft(child->getRight());
+				if(child->getRight() != NULL){
+					child->getRight()->setParent(temp);
+				}
+				child->setRight(temp);
+				temp->setParent(child);
+				temp = child;
+				depth++;
+				if(temp->getLeft() == NULL){
+					break;
+				}
+			}
+			//link temp in as the smallest node of the right tree
+			if(rightMin == NULL){
+				rightTree = temp;
 			}
 			else{
-				grand->getParent()->setRight(aNode);
+				rightMin->setLeft(temp);
 			}
-		}
-		grand->setParent(aNode);
-		parent->setParent(aNode);
-		aNode->setLeft(parent);
-		aNode->setRight(grand);
-		if(aNode == this->mRoot){
-			return current + 2;
+			temp->setParent(rightMin);
+			rightMin = temp;
+			temp = temp->getLeft();
+			depth++;
+		}
+		else if(key > temp->getKey()){
+			if(temp->getRight() == NULL){
+				break;
+			}
+			//zag-zag: rotate left before linking
+			if(key > temp->getRight()->getKey()){
+				Node<Key, Value>* child = temp->getRight();
+				temp->setRight(child->getLeft());
+				if(child->getLeft() != NULL){
+					child->getLeft()->setParent(temp);
+				}
+				child->setLeft(temp);
+				temp->setParent(child);
+				temp = child;
+				depth++;
+				if(temp->getRight() == NULL){
+					break;
+				}
+			}
+			//link temp in as the largest node of the left tree
+			if(leftMax == NULL){
+				leftTree = temp;
+			}
+			else{
+				leftMax->setRight(temp);
+			}
+			temp->setParent(leftMax);
+			leftMax = temp;
+			temp = temp->getRight();
+			depth++;
 		}
 		else{
-			return splayer(aNode, current + 2);
+			break;
 		}
 	}
-	return current;
 
+	//reassemble
+	if(leftMax != NULL){
+		leftMax->setRight(temp->getLeft());
+		if(temp->getLeft() != NULL){
+			temp->getLeft()->setParent(leftMax);
+		}
+		temp->setLeft(leftTree);
+		leftTree->setParent(temp);
+	}
+	if(rightMin != NULL){
+		rightMin->setLeft(temp->getRight());
+		if(temp->getRight() != NULL){
+			temp->getRight()->setParent(rightMin);
+		}
+		temp->setRight(rightTree);
+		rightTree->setParent(temp);
+	}
+	temp->setParent(NULL);
+	return temp;
 }
 /*
 ------------------------------------------
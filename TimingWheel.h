@@ -0,0 +1,277 @@
+#ifndef TIMINGWHEEL_H
+#define TIMINGWHEEL_H
+
+#include <iostream>
+#include <vector>
+#include <cstdint>
+#include <stdexcept>
+#include <exception>
+#include <utility>
+#include <optional>
+
+using namespace std;
+
+template <typename T>
+class TimingWheel {
+    public:
+        typedef int64_t handle;
+        /* a slot number and that slot's generation, as for MinHeap::handle,
+           so a handle kept after its timer fired or was erased is
+           rejected. */
+
+        TimingWheel (uint64_t start = 0);
+        /* Constructor that builds an empty hierarchical timing wheel whose
+          clock reads start. Deadlines are in ticks. Timers due within
+          2^24 ticks sit in one of 4 wheels of 64 slots, and later ones
+          in an overflow list. add, update and erase are O(1). advance
+          moves each timer down a wheel at most 4 times. It visits ticks
+          one by one only while wheel 0 holds timers, and otherwise jumps
+          to the next tick at which a higher wheel hands timers down. */
+
+        handle add (T item, uint64_t deadline);
+         /* adds the item as a timer that fires at the deadline. A deadline
+            that has already passed fires on the next tick. Returns a
+            handle for the item, like MinHeap::add. */
+
+        void update (handle h, uint64_t deadline);
+         /* reschedules the timer with the given handle. Throws
+            std::out_of_range if the handle is not in the wheel. */
+
+        void erase (handle h);
+         /* cancels the timer with the given handle and destroys its item.
+            Throws std::out_of_range if the handle is not in the wheel. */
+
+        template <typename Callback>
+        long long advance (uint64_t now, Callback callback);
+         /* moves the clock forward to now and fires every timer whose
+            deadline is at or before it, in deadline order one tick at a
+            time. Each timer is removed and its item is passed to
+            callback(T &) before the callback runs, so the callback may
+            add, update or erase timers. Returns the number of timers
+            fired. */
+
+        uint64_t now () const;
+         /* returns the current tick. */
+
+        bool isEmpty ();
+         /* returns true iff there are no timers in the wheel. */
+
+    private:
+        // a timer with deadline d is kept in wheel L, slot (d >> 6L) & 63,
+        // where L is the highest 6-bit digit in which d differs from the
+        // clock. When the clock reaches the start of that slot the timers
+        // in it are placed again, landing in lower wheels, and wheel 0
+        // slots fire as the clock passes them.
+        static const int LEVELS = 4;
+        static const int SLOT_BITS = 6;
+        static const int SLOTS = 1 << SLOT_BITS;
+        static const int OVERFLOW_LIST = LEVELS * SLOTS;
+
+        // value is empty while the slot is free, so a fired or erased
+        // timer's item does not outlive it, and gen counts how often the
+        // slot was freed
+        struct data{
+            uint64_t deadline;
+            int list;
+            int prev;
+            int next;
+            uint32_t gen;
+            std::optional<T> value;
+        };
+
+        void place(int id, uint64_t earliest);
+        void unlink(int id);
+        void cascade(int list);
+        void release(int id);
+        int checkHandle(handle h) const;
+
+        std::vector<data> nodes;
+        // first timer in each slot, then the overflow list, or -1
+        std::vector<int> heads;
+        // number of timers in each wheel, with the overflow list last
+        int counts[LEVELS + 1];
+        // handles that can be given out again
+        std::vector<int> free_ids;
+        uint64_t current;
+        int size;
+};
+
+template <typename T>
+TimingWheel<T>::TimingWheel(uint64_t start){
+    current = start;
+    size = 0;
+    heads.assign(OVERFLOW_LIST + 1, -1);
+    for(int level = 0; level <= LEVELS; level++){
+        counts[level] = 0;
+    }
+}
+
+template <typename T>
+typename TimingWheel<T>::handle TimingWheel<T>::add(T item, uint64_t deadline){
+    int id;
+    if(free_ids.empty()){
+        id = nodes.size();
+        nodes.emplace_back();
+        nodes[id].gen = 0;
+    }
+    else{
+        id = free_ids.back();
+        free_ids.pop_back();
+    }
+    nodes[id].value.emplace(std::move(item));
+    nodes[id].deadline = deadline;
+    place(id, current + 1);
+    size++;
+    return ((handle)nodes[id].gen << 32) | id;
+}
+
+template <typename T>
+void TimingWheel<T>::update(handle h, uint64_t deadline){
+    int n = checkHandle(h);
+    unlink(n);
+    nodes[n].deadline = deadline;
+    place(n, current + 1);
+}
+
+template <typename T>
+void TimingWheel<T>::erase(handle h){
+    int n = checkHandle(h);
+    unlink(n);
+    release(n);
+}
+
+template <typename T>
+template <typename Callback>
+long long TimingWheel<T>::advance(uint64_t now, Callback callback){
+    long long fired = 0;
+    while(current < now){
+        if(size == 0){
+            // nothing can fire or cascade, so skip straight there
+            current = now;
+            break;
+        }
+        // with the lower wheels empty, nothing happens before the lowest
+        // occupied wheel (or the overflow list) next hands a slot down
+        int lowest = 0;
+        while(counts[lowest] == 0)
+            lowest++;
+        if(lowest > 0){
+            uint64_t boundary = (current | ((uint64_t(1) << (lowest * SLOT_BITS)) - 1)) + 1;
+            if(boundary > now){
+                current = now;
+                break;
+            }
+            current = boundary - 1;
+        }
+        current++;
+
+        // the wheels whose digit just rolled over hand their slot down,
+        // highest first so timers can fall through several wheels at once
+        if((current & ((uint64_t(1) << (LEVELS * SLOT_BITS)) - 1)) == 0)
+            cascade(OVERFLOW_LIST);
+        for(int level = LEVELS - 1; level > 0; level--){
+            if((current & ((uint64_t(1) << (level * SLOT_BITS)) - 1)) == 0)
+                cascade(level * SLOTS + ((current >> (level * SLOT_BITS)) & (SLOTS - 1)));
+        }
+
+        int list = current & (SLOTS - 1);
+        while(heads[list] != -1){
+            int id = heads[list];
+            unlink(id);
+            T item = std::move(*nodes[id].value);
+            release(id);
+            fired++;
+            callback(item);
+        }
+    }
+    return fired;
+}
+
+template <typename T>
+uint64_t TimingWheel<T>::now() const{
+    return current;
+}
+
+template <typename T>
+bool TimingWheel<T>::isEmpty(){
+    if(size>0)
+        return false;
+    else
+        return true;
+}
+
+/* links a timer into the slot its deadline belongs to, treating deadlines
+   before earliest as earliest */
+template <typename T>
+void TimingWheel<T>::place(int id, uint64_t earliest){
+    uint64_t when = nodes[id].deadline;
+    if(when < earliest)
+        when = earliest;
+    uint64_t differ = when ^ current;
+
+    int list = OVERFLOW_LIST;
+    for(int level = 0; level < LEVELS; level++){
+        if(differ < (uint64_t(1) << ((level + 1) * SLOT_BITS))){
+            list = level * SLOTS + ((when >> (level * SLOT_BITS)) & (SLOTS - 1));
+            break;
+        }
+    }
+
+    nodes[id].list = list;
+    counts[list / SLOTS]++;
+    nodes[id].prev = -1;
+    nodes[id].next = heads[list];
+    if(heads[list] != -1)
+        nodes[heads[list]].prev = id;
+    heads[list] = id;
+}
+
+template <typename T>
+void TimingWheel<T>::unlink(int id){
+    data & node = nodes[id];
+    if(node.prev != -1)
+        nodes[node.prev].next = node.next;
+    else
+        heads[node.list] = node.next;
+    if(node.next != -1)
+        nodes[node.next].prev = node.prev;
+    counts[node.list / SLOTS]--;
+}
+
+/* empties a slot and places its timers again against the current clock;
+   those due now land in the wheel 0 slot that is about to fire */
+template <typename T>
+void TimingWheel<T>::cascade(int list){
+    int id = heads[list];
+    heads[list] = -1;
+    while(id != -1){
+        counts[list / SLOTS]--;
+        int next = nodes[id].next;
+        place(id, current);
+        id = next;
+    }
+}
+
+/* frees the slot of a timer that was unlinked, destroying its item */
+template <typename T>
+void TimingWheel<T>::release(int id){
+    nodes[id].list = -1;
+    // a new generation retires every handle to the slot
+    nodes[id].gen = (nodes[id].gen + 1) & 0x7fffffff;
+    nodes[id].value.reset();
+    free_ids.push_back(id);
+    size--;
+}
+
+/* returns the slot of a handle whose timer is still in the wheel, and
+   throws std::out_of_range for any other handle */
+template <typename T>
+int TimingWheel<T>::checkHandle(handle h) const{
+    long long id = h & 0xffffffff;
+    if(h < 0 || id >= (long long)nodes.size() || nodes[id].list < 0 || (h >> 32) != nodes[id].gen){
+        throw std::out_of_range("Handle is not in the wheel");
+    }
+    return id;
+}
+
+#endif